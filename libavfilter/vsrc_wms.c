@@ -15,30 +15,122 @@
  * WMS renderer
  */
 #include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#if HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+#if HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
-#include <libxml/tree.h>
 #include <libxml/parser.h>
-#include <libxml/xmlschemastypes.h>
+#include <libxml/xmlreader.h>
 #include <libxml/xmlmemory.h>
 #include <libxml/xmlstring.h>
-#include <libxml/globals.h>
 
 #include "avfilter.h"
+#include "filters.h"
+#include "formats.h"
 #include "internal.h"
-#include "lavfutils.h"
+#include "wms_fetch.h"
 #include "libavcodec/avcodec.h"
 #include "libavformat/avformat.h"
+#include "libavformat/avio_http.h"
 #include "libavutil/bprint.h"
 #include "libavutil/eval.h"
 #include "libavutil/thread.h"
+#include "libavutil/time.h"
 #include "libavutil/imgutils.h"
 #include "libavutil/opt.h"
+#include "libavutil/parseutils.h"
+#include "libavutil/pixdesc.h"
 #include "libavutil/avstring.h"
+#include "libavutil/file.h"
+#include "libavutil/file_open.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/md5.h"
+#include "libavutil/random_seed.h"
+#include "libavutil/time_internal.h"
+#include "libswscale/swscale.h"
 
 #define SQR(a) ((a)*(a))
 
 enum WMSVersion { WMS_V1_0_0, WMS_V1_1_0, WMS_V1_1_1, WMS_V1_3_0 };
 
+typedef struct {
+    double x1, y1, x2, y2;
+} MapReadContext;
+
+enum WMSTileService { WMS_TILES_NONE, WMS_TILES_XYZ, WMS_TILES_WMTS };
+
+enum WMSDim { WMS_DIM_TIME, WMS_DIM_ELEVATION, WMS_DIM_NB };
+
+/**
+ * Values start, start + step, start + 2 * step... up to end of a
+ * dimension. A zero step makes the range continuous. Times are in seconds
+ * since the epoch.
+ */
+typedef struct WMSDimRange {
+    double start, end;
+    int months;             ///< calendar part of the step
+    double step;            ///< rest of the step
+} WMSDimRange;
+
+/**
+ * Level of a Web Mercator tile pyramid, tiles are numbered from its top
+ * left corner
+ */
+typedef struct WMSTileMatrix {
+    char id[64];            ///< identifier in tile URLs
+    double res;             ///< meters per pixel
+    double x0, y0;          ///< top left corner, in meters
+    int tile_w, tile_h;
+    int64_t cols, rows;
+} WMSTileMatrix;
+
+enum WMSStat {
+    WMS_STAT_QUEUE,     ///< wait for a fetch thread
+    WMS_STAT_THROTTLE,  ///< wait for the rate limiter, the longest of the requests
+    WMS_STAT_CONC,      ///< wait for the concurrency limit
+    WMS_STAT_TTFB,      ///< from sending the request, or opening a connection, to the response headers
+    WMS_STAT_TRANSFER,  ///< reading the response body
+    WMS_STAT_DECODE,
+    WMS_STAT_FETCH,     ///< getting the frame, all included but the queue wait
+    WMS_STAT_NB
+};
+
+/**
+ * What getting a frame took, times are in us and summed over its requests,
+ * which may run in parallel
+ */
+typedef struct WMSFrameStats {
+    int64_t time[WMS_STAT_NB];
+    int64_t bytes;          ///< size of the response bodies
+    int requests;           ///< HTTP requests, retries included
+    int new_conns;          ///< connections opened, DNS, TCP and TLS setup included in ttfb
+    int disk_hits;
+    int revalidated;
+    int shm_hits;           ///< tiles from the cache shared between processes
+    int shared_hits;        ///< responses of requests another frame or instance had in flight
+    int frame_cache_hit;    ///< whether the frame is from the frame cache, frames that are in totals
+} WMSFrameStats;
+
+#define WMS_HIST_BINS 26 ///< log2 bins of us, the last one is 33 s and more
+
+typedef struct WMSHistogram {
+    uint64_t bins[WMS_HIST_BINS];
+    int64_t sum, max;
+} WMSHistogram;
+
 typedef struct WMSContext {
     const AVClass *class;
     int w, h;
@@ -52,13 +144,163 @@ typedef struct WMSContext {
     char *layers;
     char *version;
     char *service;
+    char *format;
+    char *formats;          ///< formats advertised for GetMap
+    int caps_max_width, caps_max_height;
+    int nb_layers_found;    ///< number of requested layers advertised
     char *fmt_url;
+    enum WMSTileService tile_service;
+    WMSTileMatrix *matrices;    ///< levels of the tile service, coarsest first
+    int nb_matrices;
+    char *tile_style, *tile_matrix_set; ///< WMTS template values
+    int max_zoom;
+    enum AVPixelFormat pix_fmt;
     enum WMSVersion wms_version;
+    AVExpr *exprs[6]; ///< xref, yref, x1, x2, y1, y2
+
+    int prefetch;
+    int threads;
+    int max_width, max_height;
+    int64_t timeout;
+    int retries;
+    int nb_slots;
+    struct WMSSlot *slots;  ///< reorder buffer of the prefetched frames, indexed by pts
+    uint64_t next_pts;   ///< first pts not scheduled yet
+    MapReadContext *maps;
+    pthread_t *workers;
+    int nb_workers;
+    struct WMSJob *jobs;
+    int exiting;
+    AVMutex lock;
+    AVCond cond;
+
+    int max_conns;          ///< idle keep-alive connections kept per host, 0 until configured
+
+    int min_concurrency, max_concurrency;
+    double conc_limit;      ///< current limit of requests in flight
+    int conc_inflight;
+    int conc_congested;     ///< out of slow start
+    int64_t min_latency;    ///< lowest latency observed, in us
+    int64_t avg_latency;
+    int64_t last_decrease;
+    AVMutex conc_lock;
+    AVCond conc_cond;
+
+    double request_rate;    ///< requests per second, 0 for unlimited
+    int request_burst;
+    int64_t rate_tat;       ///< time the bucket is empty until, in us
+    AVMutex rate_lock;
+
+    AVCodecContext **decoders; ///< idle opened decoders
+    int nb_decoders;
+    int max_decoders;
+    AVMutex dec_lock;
+
+    char *cache_dir;
+    int64_t cache_ttl;
+    int64_t caps_ttl;
+    int64_t cache_size;
+    int64_t cache_bytes; ///< estimated size of cache_dir
+    AVMutex cache_lock;
+
+    int tile_size;
+
+    char *time_expr, *elevation_expr;
+    char *dim_values[WMS_DIM_NB];   ///< extent of the dimension advertised for the requested layers
+    char *dim_layers[WMS_DIM_NB];   ///< requested layers having the dimension
+    AVExpr *dim_exprs[WMS_DIM_NB];
+    WMSDimRange *dim_ranges[WMS_DIM_NB];
+    int nb_dim_ranges[WMS_DIM_NB];
+    double dim_min[WMS_DIM_NB], dim_max[WMS_DIM_NB];
+    int nb_dims;            ///< animated dimensions
+    int dim_warned;
+    char *last_url;         ///< request of the previous frame, when dimensions are animated
+    AVFrame *last_frame;
+
+    int split_layers;
+    char *dynamic_layers;
+    char **layer_fmts;      ///< GetMap URL formats of the split layers, bottom first
+    uint8_t *layer_dynamic; ///< whether the split layer is never served from a cache
+    uint8_t *layer_dims;    ///< dimensions of the split layers, 1 << WMSDim flags
+    int nb_split_layers;
+    int nb_dynamic_layers;
+    int cache_layers;       ///< cache the static split layers rather than the composites
+
+    int keyframes;          ///< number of frames synthesized from each fetched image
+    double keyframe_margin;
+    double overfetch;       ///< margin fetched around frames, to crop the next ones from
+    MapReadContext *key_maps; ///< bboxes of the frames of a keyframe group
+    int64_t key_group;      ///< group key_map, key_w and key_h were computed for
+    MapReadContext key_map;
+    int key_w, key_h;       ///< size of the group keyframe, 0 to fetch its frames directly
+    struct WMSKeyframe *keys; ///< keyframes by group modulo nb_keys
+    int nb_keys;
+    int64_t open_group;     ///< last group frames were scheduled from
+    AVMutex key_lock;
+    AVCond key_cond;
+
+    char *stats_file;
+    int stats_interval;
+    int64_t nb_frames;      ///< frames accounted in hist and total
+    WMSHistogram hist[WMS_STAT_NB];
+    WMSFrameStats total;
+
+    int64_t frame_cache_size;
+    int frame_cache_auto;   ///< frame_cache_size follows the tiles of the frames
+    WMSFrameCache *frame_cache; ///< cache of fetch_svc, NULL if disabled
+
+    int shared;
+    int host_concurrency;
+    WMSFetchService *fetch_svc; ///< shared by the process if shared, else private
+
+    char *shm_name, *shm_file;
+    int64_t shm_size;
+    struct WMSShmHeader *shm;   ///< mapped tile cache shared between processes, may be NULL
+    size_t shm_map_size;
 } WMSContext;
 
-typedef struct {
-    double x1, y1, x2, y2;
-} MapReadContext;
+enum WMSSlotState {
+    WMS_SLOT_EMPTY,   ///< free, can be scheduled for a new pts
+    WMS_SLOT_QUEUED,  ///< queued to or being fetched by the worker pool
+    WMS_SLOT_DONE,    ///< frame (or error) available
+};
+
+/**
+ * One entry of the prefetch ring, slot for pts p is slots[p % nb_slots]
+ */
+typedef struct WMSSlot {
+    enum WMSSlotState state;
+    uint64_t pts;
+    MapReadContext map;
+    char dims[WMS_DIM_NB][48]; ///< query parameters of the dimensions, may be empty
+    char *url;
+    int repeat;             ///< same request as the previous frame, whose frame is reused
+    int64_t key_group;      ///< keyframe group, if key_w is not 0
+    MapReadContext key_map;
+    int key_w, key_h;
+    int key_x, key_y;       ///< position of the frame in the keyframe, with overfetch
+    AVFrame *frame;
+    int64_t queued;         ///< time the slot was submitted to the pool
+    WMSFrameStats stats;
+    int ret;
+} WMSSlot;
+
+/**
+ * Job of the worker pool, run as func(ctx, arg, jobnr)
+ */
+typedef struct WMSJob {
+    int (*func)(AVFilterContext *ctx, void *arg, int jobnr);
+    void *arg;
+    int jobnr;
+    uint64_t prio;          ///< pts the job is working for, lowest first
+    struct WMSBatch *batch; ///< batch waited for by pool_execute(), may be NULL
+    struct WMSJob *next;
+} WMSJob;
+
+typedef struct WMSBatch {
+    int pending;
+    int ret;
+} WMSBatch;
 
 #define OFFSET(x) offsetof(WMSContext, x)
 #define FLAGS AV_OPT_FLAG_VIDEO_PARAM|AV_OPT_FLAG_FILTERING_PARAM
@@ -68,7 +310,7 @@ static const AVOption wms_options[] = {
     {"s",           "set frame size",                           OFFSET(w),       AV_OPT_TYPE_IMAGE_SIZE, {.str="640x480"},  0, 0, FLAGS },
     {"rate",        "set frame rate",                           OFFSET(frame_rate), AV_OPT_TYPE_VIDEO_RATE, {.str="25"},  0, INT_MAX, FLAGS },
     {"r",           "set frame rate",                           OFFSET(frame_rate), AV_OPT_TYPE_VIDEO_RATE, {.str="25"},  0, INT_MAX, FLAGS },
-    {"end_pts",     "set the terminal pts value",               OFFSET(end_pts), AV_OPT_TYPE_DOUBLE,     {.dbl=400},  0, INT64_MAX, FLAGS },
+    {"end_pts",     "set the terminal pts value, 0 for none",   OFFSET(end_pts), AV_OPT_TYPE_DOUBLE,     {.dbl=0},    0, INT64_MAX, FLAGS },
     {"xref",        "set a x coord you can use as reference",   OFFSET(xref_expr), AV_OPT_TYPE_STRING,     {.str="0"},  0, 0, FLAGS },
     {"yref",        "set a y coord you can use as reference",   OFFSET(yref_expr), AV_OPT_TYPE_STRING,     {.str="0"},  0, 0, FLAGS },
     {"x1",          "set bbox west coords",                     OFFSET(x1_expr), AV_OPT_TYPE_STRING,     {.str="-180"},  0, 0, FLAGS },
@@ -78,257 +320,1098 @@ static const AVOption wms_options[] = {
     {"y2",          "set bbox south coords",                    OFFSET(y2_expr), AV_OPT_TYPE_STRING,     {.str="90"},  0, 0, FLAGS },
     {"url",         "set service URL without parameters",       OFFSET(capabilities_url), AV_OPT_TYPE_STRING, {.str=NULL}, 0, 0, FLAGS},
     {"layers",      "set layers parameter for WMS",             OFFSET(layers), AV_OPT_TYPE_STRING, {.str=""}, 0, 0, FLAGS},
+    {"format",      "set the image format requested to the WMS", OFFSET(format), AV_OPT_TYPE_STRING, {.str="image/png"}, 0, 0, FLAGS},
+    {"prefetch",    "set the number of frames fetched ahead",   OFFSET(prefetch), AV_OPT_TYPE_INT, {.i64=0}, 0, 64, FLAGS},
+    {"threads",     "set the number of fetch threads",          OFFSET(threads), AV_OPT_TYPE_INT, {.i64=0}, 0, 256, FLAGS},
+    {"max_width",   "set the maximum width of a GetMap request", OFFSET(max_width), AV_OPT_TYPE_INT, {.i64=0}, 0, INT_MAX, FLAGS},
+    {"max_height",  "set the maximum height of a GetMap request", OFFSET(max_height), AV_OPT_TYPE_INT, {.i64=0}, 0, INT_MAX, FLAGS},
+    {"timeout",     "set the time a request may wait for the server, 0 to wait forever", OFFSET(timeout), AV_OPT_TYPE_DURATION, {.i64=10000000}, 0, INT_MAX, FLAGS},
+    {"retries",     "set the number of retries of a failed request", OFFSET(retries), AV_OPT_TYPE_INT, {.i64=2}, 0, 100, FLAGS},
+    {"min_concurrency", "set the minimum number of requests in flight", OFFSET(min_concurrency), AV_OPT_TYPE_INT, {.i64=1}, 1, 1024, FLAGS},
+    {"max_concurrency", "set the maximum number of requests in flight, 0 for one per fetch thread", OFFSET(max_concurrency), AV_OPT_TYPE_INT, {.i64=0}, 0, 1024, FLAGS},
+    {"request_rate",  "set the maximum number of requests per second, 0 for unlimited", OFFSET(request_rate), AV_OPT_TYPE_DOUBLE, {.dbl=0}, 0, 10000, FLAGS},
+    {"request_burst", "set the number of requests that may be sent at once before request_rate applies", OFFSET(request_burst), AV_OPT_TYPE_INT, {.i64=1}, 1, 10000, FLAGS},
+    {"cache_dir",   "set directory of the persistent GetMap cache", OFFSET(cache_dir), AV_OPT_TYPE_STRING, {.str=NULL}, 0, 0, FLAGS},
+    {"cache_ttl",   "set lifetime of cached GetMap responses",  OFFSET(cache_ttl), AV_OPT_TYPE_DURATION, {.i64=86400000000LL}, 0, INT64_MAX, FLAGS},
+    {"cache_size",  "set maximum size of the GetMap cache in bytes", OFFSET(cache_size), AV_OPT_TYPE_INT64, {.i64=1LL<<30}, 0, INT64_MAX, FLAGS},
+    {"caps_ttl",    "set lifetime of cached capabilities",      OFFSET(caps_ttl), AV_OPT_TYPE_DURATION, {.i64=3600000000LL}, 0, INT64_MAX, FLAGS},
+    {"frame_cache", "set memory budget of the decoded frame cache in bytes", OFFSET(frame_cache_size), AV_OPT_TYPE_INT64, {.i64=0}, 0, INT64_MAX, FLAGS},
+    {"shared",      "share connections, requests in flight and the frame cache with the other shared instances of the process", OFFSET(shared), AV_OPT_TYPE_BOOL, {.i64=0}, 0, 1, FLAGS},
+    {"host_concurrency", "set the maximum number of requests in flight to a host over all the shared instances, 0 for unlimited", OFFSET(host_concurrency), AV_OPT_TYPE_INT, {.i64=0}, 0, 1024, FLAGS},
+    {"shm_cache",   "set the POSIX shared memory object of a tile cache shared between processes, kept until removed", OFFSET(shm_name), AV_OPT_TYPE_STRING, {.str=NULL}, 0, 0, FLAGS},
+    {"shm_cache_file", "set the file of a memory-mapped tile cache shared between processes, kept until removed", OFFSET(shm_file), AV_OPT_TYPE_STRING, {.str=NULL}, 0, 0, FLAGS},
+    {"shm_cache_size", "set the size of a shared tile cache created by this instance, in bytes", OFFSET(shm_size), AV_OPT_TYPE_INT64, {.i64=256LL<<20}, 0, INT64_MAX, FLAGS},
+    {"tile_size",   "compose frames from a fixed grid of tiles of this size", OFFSET(tile_size), AV_OPT_TYPE_INT, {.i64=0}, 0, 4096, FLAGS},
+    {"time",        "set the TIME dimension expression, in seconds since the epoch", OFFSET(time_expr), AV_OPT_TYPE_STRING, {.str=NULL}, 0, 0, FLAGS},
+    {"elevation",   "set the ELEVATION dimension expression",  OFFSET(elevation_expr), AV_OPT_TYPE_STRING, {.str=NULL}, 0, 0, FLAGS},
+    {"split_layers", "fetch each layer with its own GetMap request and composite them", OFFSET(split_layers), AV_OPT_TYPE_BOOL, {.i64=0}, 0, 1, FLAGS},
+    {"dynamic_layers", "set the split layers whose images change, which are never served from a cache", OFFSET(dynamic_layers), AV_OPT_TYPE_STRING, {.str=NULL}, 0, 0, FLAGS},
+    {"max_zoom",    "set the finest zoom level of a XYZ tile service", OFFSET(max_zoom), AV_OPT_TYPE_INT, {.i64=19}, 0, 30, FLAGS},
+    {"keyframes",   "fetch one image per this many frames and resample the others from it", OFFSET(keyframes), AV_OPT_TYPE_INT, {.i64=0}, 0, 1024, FLAGS},
+    {"keyframe_margin", "set the margin fetched around the bboxes of a keyframe group, relative to its size", OFFSET(keyframe_margin), AV_OPT_TYPE_DOUBLE, {.dbl=0.1}, 0, 1, FLAGS},
+    {"stats_file",  "write fetch statistics to this file as JSON when done", OFFSET(stats_file), AV_OPT_TYPE_STRING, {.str=NULL}, 0, 0, FLAGS},
+    {"stats_interval", "log fetch statistics every this many frames", OFFSET(stats_interval), AV_OPT_TYPE_INT, {.i64=0}, 0, INT_MAX, FLAGS},
+    {"overfetch",   "fetch this margin around frames, relative to their size, and crop the next frames from it while they fit", OFFSET(overfetch), AV_OPT_TYPE_DOUBLE, {.dbl=0}, 0, 1, FLAGS},
     {NULL},
 };
 
 AVFILTER_DEFINE_CLASS(wms);
 
-static xmlNodePtr find_child_xml(xmlNodePtr node,const char* name) {
-    xmlNodePtr search;
-    if(node == NULL) return NULL;
-    for(search = node->children;
-        search && xmlStrcasecmp(search->name, (xmlChar *)name) != 0;
-        search = search->next) {
-    }
-    return search;
-}
+static const char *const dim_names[WMS_DIM_NB] = { "time", "elevation" };
 
-static int parse_xml(const xmlDocPtr doc, AVFilterContext *ctx) {
-    WMSContext *s = ctx->priv;
-    xmlNodePtr nodeptr, serviceptr, getmapptr;
-    xmlChar *version, *url;
+#define WMS_XLINK_NS      "http://www.w3.org/1999/xlink"
+#define WMS_XML_MAX_DEPTH 64
 
-    nodeptr = xmlDocGetRootElement(doc);
-    if (nodeptr == NULL) {
-        av_log(ctx, AV_LOG_ERROR, "Error reading XML root\n");
-        return AVERROR(EIO);
-    }
+/**
+ * State of the streaming GetCapabilities parser. Only the path of the
+ * current element is kept, the document is never built in memory.
+ */
+typedef struct WMSCapsParser {
+    AVFilterContext *ctx;
+    xmlTextReaderPtr reader;
+    char path[1024];                        ///< path of the current element, without the root
+    int path_len[WMS_XML_MAX_DEPTH + 1];    ///< length of path for each depth
+    uint8_t layer_match[WMS_XML_MAX_DEPTH]; ///< whether the Layer at this depth is requested
+    int nb_layers;                          ///< number of requested layers
+    int nb_layers_done;                     ///< number of requested layers fully read
+    int has_service, has_getmap;
+    AVBPrint formats;
+    int dim;                                ///< of the current Dimension or Extent, -1 if none
+    char *dims[WMS_XML_MAX_DEPTH][WMS_DIM_NB]; ///< declared by the Layer at this depth, inherited by nested ones
+    char *layer_name[WMS_XML_MAX_DEPTH];    ///< of the requested Layer at this depth
 
-    version = xmlGetProp(nodeptr, (const xmlChar *)"version");
-    if(version == NULL) {
-        av_log(ctx, AV_LOG_ERROR, "Could not read version\n");
-        return AVERROR(EINVAL);
-    }
-    s->version = (char *)xmlStrdup(version);
-    xmlFree(version);
+    // WMTS Capabilities, only the first requested layer is read
+    int wmts;
+    int wmts_match;                         ///< the current Layer is the requested one
+    int wmts_layer_done;
+    char *wmts_tmpl, *wmts_style;           ///< of the current Layer
+    int wmts_tmpl_match;                    ///< wmts_tmpl has the requested format
+    int wmts_style_default;
+    AVBPrint wmts_sets;                     ///< TileMatrixSets linked to the current Layer
+    char *wmts_links;                       ///< TileMatrixSets linked to the requested layer
+    char *wmts_set_id;                      ///< of the current TileMatrixSet
+    int wmts_set_mercator;
+    WMSTileMatrix wmts_tm;                  ///< current TileMatrix
+    WMSTileMatrix *wmts_matrices;           ///< of the current TileMatrixSet
+    int wmts_nb_matrices;
+} WMSCapsParser;
 
-    serviceptr = find_child_xml(nodeptr, "Service");
-    if(serviceptr == NULL) {
-        av_log(ctx, AV_LOG_ERROR, "Could not find Service node in GetCapabilities XML\n");
-        return AVERROR(EINVAL);
-    }
+/**
+ * Look for name in a comma separated list of layers
+ */
+static int layer_requested(const char *layers, const char *name)
+{
+    size_t len = strlen(name);
 
-    nodeptr = find_child_xml(nodeptr, "Capability");
-    nodeptr = find_child_xml(nodeptr, "Request");
-    getmapptr = nodeptr = find_child_xml(nodeptr, "GetMap");
-    if(getmapptr == NULL) {
-        av_log(ctx, AV_LOG_ERROR, "Could not find GetMap node in GetCapabilities XML\n");
-        return AVERROR(EINVAL);
+    while (*layers) {
+        size_t n = strcspn(layers, ",");
+        if (n == len && !strncmp(layers, name, n))
+            return 1;
+        layers += n + !!layers[n];
     }
+    return 0;
+}
 
-    nodeptr = find_child_xml(serviceptr, "Name");
-    if(nodeptr == NULL || nodeptr->children == NULL || nodeptr->children->content == NULL) {
-        av_log(ctx, AV_LOG_WARNING, "Could not read service name, using 'WMS'\n");
-        s->service = strdup("WMS");
-    }else {
-        s->service = (char *)xmlStrdup(serviceptr->children->content);
-    }
+static int count_layers(const char *layers)
+{
+    int nb = 0;
 
-    nodeptr = find_child_xml(getmapptr, "DCPType");
-    nodeptr = find_child_xml(nodeptr, "HTTP");
-    nodeptr = find_child_xml(nodeptr, "Get");
-    nodeptr = find_child_xml(nodeptr, "OnlineResource");
-    if(nodeptr == NULL) {
-        av_log(ctx, AV_LOG_ERROR, "Could not read OnlineResource node\n");
-        return AVERROR(EINVAL);
-    }
-    url = xmlGetNsProp(nodeptr, "href", "xlink");
-    if(url == NULL) {
-        av_log(ctx, AV_LOG_WARNING, "Could not read URL property for GetMap, using the same as GetCapabilities\n");
-        s->url = strdup(s->capabilities_url);
-    }else {
-        s->url = (char *)xmlStrdup(url);
-        xmlFree(url);
+    while (*layers) {
+        size_t n = strcspn(layers, ",");
+        nb += n > 0;
+        layers += n + !!layers[n];
     }
-    return 0;
+    return nb;
 }
 
-static char* prepare_capabilities_url(char *opt_capurl) {
-    char tmp, *lastchr, *url;
-    //Clean URL: remove # and ?
-    #define IS_CLEANURL(ch) ch!=0 & ch!='?' && ch!='#'
-    for(lastchr= opt_capurl; IS_CLEANURL(*lastchr); lastchr++){}
-    tmp = *lastchr;
-    *lastchr = 0;
-    url = av_asprintf("%s?request=GetCapabilities", opt_capurl);
-    *lastchr = tmp;
-    return url;
+#define WMS_MERCATOR_R   6378137.0
+#define WMS_MERCATOR_MAX 20037508.342789244 ///< half the extent of Web Mercator, in meters
+#define WMS_MERCATOR_LAT 85.0511287798066   ///< latitude of WMS_MERCATOR_MAX
+#define WMS_WMTS_PIXEL   0.00028            ///< pixel size of WMTS scale denominators, in meters
+
+static int is_web_mercator(const char *crs)
+{
+    return strstr(crs, "3857") || strstr(crs, "900913") || strstr(crs, "3785") ||
+           strstr(crs, "102100");
 }
 
-static int read_xml(AVFilterContext *ctx) {
-    WMSContext *s = ctx->priv;
-    AVIOContext *io_ctx = NULL;
-    int ret;
-    AVBPrint buf;
-    xmlDocPtr doc = NULL;
-    char *url = prepare_capabilities_url(s->capabilities_url);
-    ret = avio_open2(&io_ctx, url, AVIO_FLAG_READ, NULL, NULL);
-    if (ret < 0) {
-        av_log(ctx, AV_LOG_ERROR, "Error opening GetCapabilities URL: %s\n", av_err2str(ret));
-        goto end;
+static int cmp_matrix_res(const void *a, const void *b)
+{
+    const WMSTileMatrix *ma = a, *mb = b;
+    return (ma->res < mb->res) - (ma->res > mb->res);
+}
+
+static int wmts_start_element(WMSCapsParser *p)
+{
+    WMSContext *s = p->ctx->priv;
+    int ret = 0;
+
+    // Tens of thousands of layers may follow the requested one
+    if (p->wmts_layer_done && !strcmp(p->path, "/Contents/Layer"))
+        return 1;
+
+    if (!strcmp(p->path, "/Contents/Layer/Style")) {
+        xmlChar *def = xmlTextReaderGetAttribute(p->reader, (const xmlChar *)"isDefault");
+        p->wmts_style_default = def && !strcmp((const char *)def, "true");
+        xmlFree(def);
+    } else if (!strcmp(p->path, "/Contents/Layer/ResourceURL")) {
+        xmlChar *type   = xmlTextReaderGetAttribute(p->reader, (const xmlChar *)"resourceType");
+        xmlChar *format = xmlTextReaderGetAttribute(p->reader, (const xmlChar *)"format");
+        xmlChar *tmpl   = xmlTextReaderGetAttribute(p->reader, (const xmlChar *)"template");
+        int match = format && !av_strcasecmp((const char *)format, s->format);
+
+        if (type && tmpl && !strcmp((const char *)type, "tile") &&
+            (!p->wmts_tmpl || (match && !p->wmts_tmpl_match))) {
+            av_free(p->wmts_tmpl);
+            p->wmts_tmpl       = av_strdup((const char *)tmpl);
+            p->wmts_tmpl_match = match;
+            if (!p->wmts_tmpl)
+                ret = AVERROR(ENOMEM);
+        }
+        xmlFree(type);
+        xmlFree(format);
+        xmlFree(tmpl);
+    } else if (!strcmp(p->path, "/Contents/TileMatrixSet/TileMatrix")) {
+        memset(&p->wmts_tm, 0, sizeof(p->wmts_tm));
     }
+    return ret;
+}
 
-    // Must read all the XML to parse it
-    av_bprint_init(&buf, 0, INT_MAX);
-    avio_read_to_bprint(io_ctx, &buf, INT_MAX);
+static int wmts_text(WMSCapsParser *p, const char *value)
+{
+    WMSContext *s = p->ctx->priv;
+    WMSTileMatrix *tm = &p->wmts_tm;
+    const char *field;
 
-    doc = xmlReadMemory(buf.str, buf.len, url, NULL, 0);
-    if (doc == NULL) {
-        av_log(ctx, AV_LOG_ERROR, "Error reading XML file\n");
-        ret = EIO;
+    if (!strcmp(p->path, "/Contents/Layer/Identifier")) {
+        p->wmts_match = layer_requested(s->layers, value);
+    } else if (!strcmp(p->path, "/Contents/Layer/Style/Identifier")) {
+        if (!p->wmts_style || p->wmts_style_default) {
+            av_free(p->wmts_style);
+            if (!(p->wmts_style = av_strdup(value)))
+                return AVERROR(ENOMEM);
+        }
+    } else if (!strcmp(p->path, "/Contents/Layer/TileMatrixSetLink/TileMatrixSet")) {
+        av_bprintf(&p->wmts_sets, "%s%s", p->wmts_sets.len ? "," : "", value);
+    } else if (!strcmp(p->path, "/Contents/TileMatrixSet/Identifier")) {
+        av_free(p->wmts_set_id);
+        if (!(p->wmts_set_id = av_strdup(value)))
+            return AVERROR(ENOMEM);
+    } else if (!strcmp(p->path, "/Contents/TileMatrixSet/SupportedCRS")) {
+        p->wmts_set_mercator = is_web_mercator(value);
+    } else if (av_strstart(p->path, "/Contents/TileMatrixSet/TileMatrix/", &field)) {
+        if (!strcmp(field, "Identifier"))
+            av_strlcpy(tm->id, value, sizeof(tm->id));
+        else if (!strcmp(field, "ScaleDenominator"))
+            tm->res = strtod(value, NULL) * WMS_WMTS_PIXEL;
+        else if (!strcmp(field, "TopLeftCorner"))
+            sscanf(value, "%lf %lf", &tm->x0, &tm->y0);
+        else if (!strcmp(field, "TileWidth"))
+            tm->tile_w = strtol(value, NULL, 10);
+        else if (!strcmp(field, "TileHeight"))
+            tm->tile_h = strtol(value, NULL, 10);
+        else if (!strcmp(field, "MatrixWidth"))
+            tm->cols = strtoll(value, NULL, 10);
+        else if (!strcmp(field, "MatrixHeight"))
+            tm->rows = strtoll(value, NULL, 10);
     }
+    return 0;
+}
 
-    ret = parse_xml(doc, ctx);
-end:
-    avio_close(io_ctx);
-    av_bprint_finalize(&buf, NULL);
-    av_free(url);
-    xmlFreeDoc(doc);
-    xmlCleanupParser();
+static int wmts_end_element(WMSCapsParser *p)
+{
+    WMSContext *s = p->ctx->priv;
+    int ret = 0;
+
+    if (!strcmp(p->path, "/Contents/Layer")) {
+        if (p->wmts_match && !p->wmts_layer_done) {
+            p->wmts_layer_done = 1;
+            FFSWAP(char *, s->url, p->wmts_tmpl);
+            FFSWAP(char *, s->tile_style, p->wmts_style);
+            if ((ret = av_bprint_finalize(&p->wmts_sets, &p->wmts_links)) < 0)
+                return ret;
+            av_bprint_init(&p->wmts_sets, 0, AV_BPRINT_SIZE_UNLIMITED);
+        }
+        av_freep(&p->wmts_tmpl);
+        av_freep(&p->wmts_style);
+        av_bprint_clear(&p->wmts_sets);
+        p->wmts_match = p->wmts_tmpl_match = 0;
+    } else if (!strcmp(p->path, "/Contents/TileMatrixSet/TileMatrix")) {
+        const WMSTileMatrix *tm = &p->wmts_tm;
+        WMSTileMatrix *matrices;
+
+        if (!(tm->res > 0 && tm->tile_w > 0 && tm->tile_h > 0 && tm->cols > 0 && tm->rows > 0))
+            return 0;
+        matrices = av_realloc_array(p->wmts_matrices, p->wmts_nb_matrices + 1, sizeof(*matrices));
+        if (!matrices)
+            return AVERROR(ENOMEM);
+        p->wmts_matrices = matrices;
+        p->wmts_matrices[p->wmts_nb_matrices++] = *tm;
+    } else if (!strcmp(p->path, "/Contents/TileMatrixSet")) {
+        // Layers come before TileMatrixSets in Contents
+        if (p->wmts_links && !s->nb_matrices && p->wmts_set_mercator &&
+            p->wmts_nb_matrices && p->wmts_set_id && layer_requested(p->wmts_links, p->wmts_set_id)) {
+            qsort(p->wmts_matrices, p->wmts_nb_matrices, sizeof(*p->wmts_matrices), cmp_matrix_res);
+            FFSWAP(WMSTileMatrix *, s->matrices, p->wmts_matrices);
+            FFSWAP(char *, s->tile_matrix_set, p->wmts_set_id);
+            s->nb_matrices = p->wmts_nb_matrices;
+        }
+        av_freep(&p->wmts_matrices);
+        av_freep(&p->wmts_set_id);
+        p->wmts_nb_matrices  = 0;
+        p->wmts_set_mercator = 0;
+    }
     return ret;
 }
 
-static int parse_getcapabilities(AVFilterContext *ctx) {
-    return read_xml(ctx);
+static int path_ends_with(const char *path, const char *suffix)
+{
+    size_t len = strlen(path), n = strlen(suffix);
+    return len >= n && !strcmp(path + len - n, suffix);
 }
 
-#define WMS_REQARG_SERVICE "service=%s"
-#define WMS_REQARG_VERSION "version=%s"
-#define WMS_REQARG_REQUEST "request=%s"
-#define WMS_REQARG_LAYERS "layers=%s"
-#define WMS_REQARG_STYLES "styles=%s"
-#define WMS_REQARG_FORMAT "format=%s"
-#define WMS_REQARG_BBOX "bbox=%%lf,%%lf,%%lf,%%lf"
-#define WMS_REQARG_WIDTH "width=%d"
-#define WMS_REQARG_HEIGHT "height=%d"
-#define WMS_REQARG_SRS "srs=%s"
-#define WMS_REQARG_CRS "crs=%s"
-
-#define WMS_1_1_X_REQARGS "%s?" \
-    WMS_REQARG_SERVICE "&" WMS_REQARG_VERSION "&" WMS_REQARG_REQUEST "&" \
-    WMS_REQARG_LAYERS "&" WMS_REQARG_STYLES "&" WMS_REQARG_FORMAT "&" \
-    WMS_REQARG_BBOX "&" WMS_REQARG_WIDTH "&" WMS_REQARG_HEIGHT "&" \
-    WMS_REQARG_SRS
+/**
+ * @return 1 if the element and its children must be skipped, else 0 or
+ * a negative error code
+ */
+static int caps_start_element(WMSCapsParser *p, int depth, const char *name)
+{
+    WMSContext *s = p->ctx->priv;
+    int len, ret;
 
-#define WMS_1_3_0_REQARGS "%s?" \
-    WMS_REQARG_SERVICE "&" WMS_REQARG_VERSION "&" WMS_REQARG_REQUEST "&" \
-    WMS_REQARG_LAYERS "&" WMS_REQARG_STYLES "&" WMS_REQARG_FORMAT "&" \
-    WMS_REQARG_BBOX "&" WMS_REQARG_WIDTH "&" WMS_REQARG_HEIGHT "&" \
-    WMS_REQARG_CRS
+    if (depth == 0) {
+        xmlChar *version;
 
-static int init_version(AVFilterContext *ctx) {
-    WMSContext *s = ctx->priv;
-    if(strcmp(s->version, "1.3.0") == 0) {
-        s->wms_version = WMS_V1_3_0;
-        return 0;
+        // WMS uses WMS_Capabilities or WMT_MS_Capabilities
+        if (!strcmp(name, "Capabilities")) {
+            p->wmts = 1;
+            s->tile_service = WMS_TILES_WMTS;
+        }
+        version = xmlTextReaderGetAttribute(p->reader, (const xmlChar *)"version");
+        if (!version) {
+            av_log(p->ctx, AV_LOG_ERROR, "Could not read version\n");
+            return AVERROR(EINVAL);
+        }
+        s->version = av_strdup((const char *)version);
+        xmlFree(version);
+        p->path_len[1] = 0;
+        return s->version ? 0 : AVERROR(ENOMEM);
     }
-    if(strcmp(s->version, "1.1.1") == 0) {
-        s->wms_version = WMS_V1_1_1;
-        return 0;
+
+    // Nothing of interest lies that deep
+    if (depth >= WMS_XML_MAX_DEPTH)
+        return 1;
+    len = p->path_len[depth];
+    ret = snprintf(p->path + len, sizeof(p->path) - len, "/%s", name);
+    if (ret < 0 || ret >= sizeof(p->path) - len)
+        return 1;
+    p->path_len[depth + 1] = len + ret;
+    p->layer_match[depth]  = 0;
+    if (p->wmts)
+        return wmts_start_element(p);
+
+    // WMS 1.3.0 gives the values in Dimension, 1.1.x in Extent
+    p->dim = -1;
+    if (av_strstart(p->path, "/Capability/", NULL) &&
+        (path_ends_with(p->path, "/Layer/Dimension") || path_ends_with(p->path, "/Layer/Extent"))) {
+        xmlChar *dim = xmlTextReaderGetAttribute(p->reader, (const xmlChar *)"name");
+        for (int d = 0; dim && d < WMS_DIM_NB; d++)
+            if (!av_strcasecmp((const char *)dim, dim_names[d]))
+                p->dim = d;
+        xmlFree(dim);
     }
-    if(strcmp(s->version, "1.1.0") == 0) {
-        s->wms_version = WMS_V1_1_0;
-        return 0;
+
+    if (!s->url && !strcmp(p->path, "/Capability/Request/GetMap/DCPType/HTTP/Get/OnlineResource")) {
+        xmlChar *url = xmlTextReaderGetAttributeNs(p->reader, (const xmlChar *)"href",
+                                                   (const xmlChar *)WMS_XLINK_NS);
+        if (url) {
+            s->url = av_strdup((const char *)url);
+            xmlFree(url);
+            if (!s->url)
+                return AVERROR(ENOMEM);
+        }
     }
+    return 0;
+}
 
-    av_log(ctx, AV_LOG_ERROR,
-           "WMS version '%s' not implemented. Available versions are '1.0.0' , '1.1.0', '1.1.1' and '1.3.0'\n",
-           s->version);
+static int caps_text(WMSCapsParser *p, int depth, const char *value)
+{
+    WMSContext *s = p->ctx->priv;
+    const char *path = p->path;
 
-    return AVERROR(EINVAL);
+    if (depth < 2 || depth > WMS_XML_MAX_DEPTH)
+        return 0;
+    p->path[p->path_len[depth]] = 0;
+    if (p->wmts)
+        return wmts_text(p, value);
+
+    if (!strcmp(path, "/Service/Name")) {
+        if (!s->service && !(s->service = av_strdup(value)))
+            return AVERROR(ENOMEM);
+    } else if (!strcmp(path, "/Service/MaxWidth")) {
+        s->caps_max_width = strtol(value, NULL, 10);
+    } else if (!strcmp(path, "/Service/MaxHeight")) {
+        s->caps_max_height = strtol(value, NULL, 10);
+    } else if (!strcmp(path, "/Capability/Request/GetMap/Format")) {
+        av_bprintf(&p->formats, "%s%s", p->formats.len ? "," : "", value);
+    } else if (av_strstart(path, "/Capability/", NULL) && path_ends_with(path, "/Layer/Name")) {
+        if (layer_requested(s->layers, value)) {
+            p->layer_match[depth - 2] = 1;
+            av_free(p->layer_name[depth - 2]);
+            if (!(p->layer_name[depth - 2] = av_strdup(value)))
+                return AVERROR(ENOMEM);
+        }
+    } else if (p->dim >= 0) {
+        char **values = &p->dims[depth - 2][p->dim], *v;
 
+        av_free(*values);
+        if (!(*values = v = av_malloc(strlen(value) + 1)))
+            return AVERROR(ENOMEM);
+        // Lists may be wrapped, values never have spaces
+        for (; *value; value++)
+            if (!av_isspace(*value))
+                *v++ = *value;
+        *v = 0;
+    }
+    return 0;
 }
 
-static char* format_url_arg(char* raw_arg) {
-    #define NONEED_ESCAPE(ch) \
-        (ch >='a' && ch <= 'z') || (ch >='A' && ch <= 'Z') || \
-        (ch >='-' && ch <= '9' && ch != '/') ||(ch == '~' || ch == '_')
+/**
+ * Record the dimensions of the requested layer at depth, its own or
+ * inherited. The extent of the first layer having a dimension is used.
+ */
+static int layer_dimensions(WMSCapsParser *p, int depth)
+{
+    WMSContext *s = p->ctx->priv;
 
-    int dst_i = 0;
-    int ret;
-    int result_size = 1;
-    char* dst;
-    char c;
-    for (int i=0; (c=raw_arg[i]) != 0; i++) {
-        if (NONEED_ESCAPE(c)) {
-            result_size++;
-        }else {
-            result_size += 4;
-        }
+    for (int d = 0; d < WMS_DIM_NB; d++) {
+        const char *values = NULL;
+        char *layers;
+
+        for (int i = depth; i >= 0 && !values; i--)
+            values = p->dims[i][d];
+        if (!values)
+            continue;
+        if (!s->dim_values[d] && !(s->dim_values[d] = av_strdup(values)))
+            return AVERROR(ENOMEM);
+        layers = s->dim_layers[d] ? av_asprintf("%s,%s", s->dim_layers[d], p->layer_name[depth])
+                                  : av_strdup(p->layer_name[depth]);
+        if (!layers)
+            return AVERROR(ENOMEM);
+        av_free(s->dim_layers[d]);
+        s->dim_layers[d] = layers;
     }
+    return 0;
+}
 
-    dst = av_malloc(result_size);
-    dst[0] = 0;
+static int caps_end_element(WMSCapsParser *p, int depth)
+{
+    int ret = 0;
 
-    for (int i=0; (c=raw_arg[i]) != 0; i++) {
-        if (NONEED_ESCAPE(c)) {
-            dst[dst_i] = c;
-            dst_i++;
-            dst[dst_i] = '\0';
-        }else {
-            // adds %%xx instead of special char
-            ret = snprintf(&dst[dst_i], 5, "%%%%%02X", (uint8_t)c);
-            if (ret < 0) return NULL;
-            if(ret < 4){ dst_i += ret; }else{ dst_i += 4; }
-        }
+    if (depth == 0 || depth >= WMS_XML_MAX_DEPTH)
+        return 0;
+    p->path[p->path_len[depth + 1]] = 0;
+    if (p->wmts)
+        return wmts_end_element(p);
+
+    if (!strcmp(p->path, "/Service"))
+        p->has_service = 1;
+    else if (!strcmp(p->path, "/Capability/Request/GetMap"))
+        p->has_getmap = 1;
+    else if (p->layer_match[depth]) {
+        p->layer_match[depth] = 0;
+        p->nb_layers_done++;
+        ret = layer_dimensions(p, depth);
     }
-    return dst;
+    for (int d = 0; d < WMS_DIM_NB; d++)
+        av_freep(&p->dims[depth][d]);
+    av_freep(&p->layer_name[depth]);
+    p->dim = -1;
+    return ret;
 }
 
-#define WMS_REQVAL_REQUEST "GetMap"
-#define WMS_REQVAL_STYLES ""
-#define WMS_REQVAL_FORMAT "image/png"
-#define WMS_REQVAL_PROJ "EPSG:4326"
+static int caps_read(void *opaque, char *buf, int len)
+{
+    int ret = avio_read(opaque, buf, len);
+    return ret == AVERROR_EOF ? 0 : ret < 0 ? -1 : ret;
+}
 
 /**
- *
- * @return -1 if an error occurs, 0 if format has been forced, else 1
+ * Read GetCapabilities from pb, stopping as soon as everything needed is
+ * known: a service's capabilities may be tens of MB of layers.
  */
-static int init_format_force(AVFilterContext *ctx){
-    char *src_c, *dst_c;
-    uint8_t force_flag;
-    int url_length;
+static int parse_xml(AVIOContext *pb, const char *url, AVFilterContext *ctx) {
     WMSContext *s = ctx->priv;
+    WMSCapsParser p = {
+        .ctx       = ctx,
+        .nb_layers = count_layers(s->layers),
+        .dim       = -1,
+    };
+    int skip = 0, ret;
 
-    if( s->capabilities_url == NULL ){
-        av_log(ctx, AV_LOG_ERROR, "'url' is needed\n" );
-        return -1;
+    av_bprint_init(&p.formats, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprint_init(&p.wmts_sets, 0, AV_BPRINT_SIZE_UNLIMITED);
+    p.reader = xmlReaderForIO(caps_read, NULL, pb, url, NULL, XML_PARSE_NONET);
+    if (!p.reader) {
+        av_log(ctx, AV_LOG_ERROR, "Error creating XML reader\n");
+        ret = AVERROR(ENOMEM);
+        goto end;
     }
-    if(s->capabilities_url[0] == '%'){
-        force_flag = 0;
-        url_length = 1;
-        for(src_c = s->capabilities_url+1; *src_c != 0; src_c++){
-            url_length++;
-            if (*src_c == '%' || *src_c == '{') url_length++;
+
+    // Skipping an element moves to its next sibling, without end element
+    while ((ret = skip ? xmlTextReaderNext(p.reader) : xmlTextReaderRead(p.reader)) == 1) {
+        int depth = xmlTextReaderDepth(p.reader);
+        const char *name = (const char *)xmlTextReaderConstLocalName(p.reader);
+
+        skip = 0;
+        switch (xmlTextReaderNodeType(p.reader)) {
+        case XML_READER_TYPE_ELEMENT:
+            if ((ret = caps_start_element(&p, depth, name)) < 0)
+                goto end;
+            if ((skip = ret))
+                continue;
+            if (xmlTextReaderIsEmptyElement(p.reader) && (ret = caps_end_element(&p, depth)) < 0)
+                goto end;
+            break;
+        case XML_READER_TYPE_TEXT:
+        case XML_READER_TYPE_CDATA:
+            if ((ret = caps_text(&p, depth, (const char *)xmlTextReaderConstValue(p.reader))) < 0)
+                goto end;
+            break;
+        case XML_READER_TYPE_END_ELEMENT:
+            if ((ret = caps_end_element(&p, depth)) < 0)
+                goto end;
+            break;
         }
-        s->fmt_url = av_malloc(url_length++);
-        src_c = 1+s->capabilities_url;
-        dst_c = s->fmt_url;
-        while( *src_c != '\0' ){
-            *dst_c = *src_c;
-            // Repeat %
-            if(*src_c == '%'){
-                dst_c++;
-                *dst_c = *src_c;
-            }
-            #define WMS_FORCEURL_X1FLAG (1<<0)
-            #define WMS_FORCEURL_Y1FLAG (1<<1)
-            #define WMS_FORCEURL_X2FLAG (1<<2)
-            #define WMS_FORCEURL_Y2FLAG (1<<3)
 
-            if(*src_c == '{'){
-                if(strncmp(src_c,"{x1}",4) == 0){
-                    memcpy(dst_c, "%1$lf", 5); src_c += 3; dst_c += 4;
+        if (p.wmts ? p.wmts_layer_done && s->nb_matrices :
+            p.has_service && p.has_getmap && p.nb_layers_done >= p.nb_layers) {
+            av_log(ctx, AV_LOG_DEBUG, "Stopped reading GetCapabilities after %"PRId64" bytes\n",
+                   avio_tell(pb));
+            break;
+        }
+    }
+    if (ret < 0) {
+        av_log(ctx, AV_LOG_ERROR, "Error reading XML file\n");
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    ret = AVERROR(EINVAL);
+    if (!s->version) {
+        av_log(ctx, AV_LOG_ERROR, "Could not read version\n");
+        goto end;
+    }
+    if (p.wmts) {
+        if (!p.wmts_layer_done) {
+            av_log(ctx, AV_LOG_ERROR, "Layer '%s' not found in WMTS capabilities\n", s->layers);
+            goto end;
+        }
+        if (!s->url) {
+            av_log(ctx, AV_LOG_ERROR, "No tile ResourceURL for layer '%s'\n", s->layers);
+            goto end;
+        }
+        if (!s->nb_matrices) {
+            av_log(ctx, AV_LOG_ERROR, "No Web Mercator TileMatrixSet for layer '%s'\n", s->layers);
+            goto end;
+        }
+        ret = AVERROR(ENOMEM);
+        if (!(s->service = av_strdup("WMTS")) || !(s->formats = av_strdup("")) ||
+            (!s->tile_style && !(s->tile_style = av_strdup("default"))))
+            goto end;
+        s->nb_layers_found = 1;
+        ret = 0;
+        goto end;
+    }
+    if (!p.has_service) {
+        av_log(ctx, AV_LOG_ERROR, "Could not find Service node in GetCapabilities XML\n");
+        goto end;
+    }
+    if (!p.has_getmap) {
+        av_log(ctx, AV_LOG_ERROR, "Could not find GetMap node in GetCapabilities XML\n");
+        goto end;
+    }
+    ret = AVERROR(ENOMEM);
+    if (!s->service) {
+        av_log(ctx, AV_LOG_WARNING, "Could not read service name, using 'WMS'\n");
+        if (!(s->service = av_strdup("WMS")))
+            goto end;
+    }
+    if (!s->url) {
+        av_log(ctx, AV_LOG_WARNING, "Could not read URL property for GetMap, using the same as GetCapabilities\n");
+        if (!(s->url = av_strdup(s->capabilities_url)))
+            goto end;
+    }
+    if ((ret = av_bprint_finalize(&p.formats, &s->formats)) < 0)
+        goto end;
+    s->nb_layers_found = p.nb_layers_done;
+    ret = 0;
+end:
+    av_bprint_finalize(&p.formats, NULL);
+    av_bprint_finalize(&p.wmts_sets, NULL);
+    av_free(p.wmts_tmpl);
+    av_free(p.wmts_style);
+    av_free(p.wmts_links);
+    av_free(p.wmts_set_id);
+    av_free(p.wmts_matrices);
+    for (int i = 0; i < WMS_XML_MAX_DEPTH; i++) {
+        for (int d = 0; d < WMS_DIM_NB; d++)
+            av_free(p.dims[i][d]);
+        av_free(p.layer_name[i]);
+    }
+    xmlFreeTextReader(p.reader);
+    return ret;
+}
+
+static char* prepare_capabilities_url(char *opt_capurl) {
+    char tmp, *lastchr, *url;
+    //Clean URL: remove # and ?
+    #define IS_CLEANURL(ch) ch!=0 & ch!='?' && ch!='#'
+    for(lastchr= opt_capurl; IS_CLEANURL(*lastchr); lastchr++){}
+    tmp = *lastchr;
+    *lastchr = 0;
+    url = av_asprintf("%s?request=GetCapabilities", opt_capurl);
+    *lastchr = tmp;
+    return url;
+}
+
+/**
+ * HTTP validators of a response, empty if unknown
+ */
+typedef struct WMSValidators {
+    char *etag;
+    char *last_modified;
+} WMSValidators;
+
+static void validators_free(WMSValidators *v)
+{
+    av_freep(&v->etag);
+    av_freep(&v->last_modified);
+}
+
+/**
+ * Make the next request conditional. Empty validators must still be set as
+ * options stick to a reused connection.
+ */
+static void set_validators(AVDictionary **opts, const char *etag, const char *last_modified)
+{
+    av_dict_set(opts, "if_none_match",     etag          ? etag          : "", 0);
+    av_dict_set(opts, "if_modified_since", last_modified ? last_modified : "", 0);
+}
+
+static void get_validators(AVIOContext *pb, WMSValidators *v)
+{
+    validators_free(v);
+    av_opt_get(pb, "etag",          AV_OPT_SEARCH_CHILDREN, (uint8_t **)&v->etag);
+    av_opt_get(pb, "last_modified", AV_OPT_SEARCH_CHILDREN, (uint8_t **)&v->last_modified);
+}
+
+static int get_http_code(AVIOContext *pb)
+{
+    int64_t code;
+    return av_opt_get_int(pb, "http_code", AV_OPT_SEARCH_CHILDREN, &code) >= 0 ? code : 0;
+}
+
+static int not_modified(AVIOContext *pb)
+{
+    return get_http_code(pb) == 304;
+}
+
+static void caps_reset(WMSContext *s)
+{
+    av_freep(&s->version);
+    av_freep(&s->service);
+    av_freep(&s->url);
+    av_freep(&s->formats);
+    av_freep(&s->matrices);
+    av_freep(&s->tile_style);
+    av_freep(&s->tile_matrix_set);
+    for (int d = 0; d < WMS_DIM_NB; d++) {
+        av_freep(&s->dim_values[d]);
+        av_freep(&s->dim_layers[d]);
+    }
+    s->caps_max_width = s->caps_max_height = 0;
+    s->nb_layers_found = 0;
+    s->nb_matrices = 0;
+    s->tile_service = WMS_TILES_NONE;
+}
+
+static av_cold int init_rate_limit(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    int ret;
+
+    if ((ret = ff_mutex_init(&s->rate_lock, NULL))) {
+        s->request_rate = 0;
+        return AVERROR(ret);
+    }
+    return 0;
+}
+
+/**
+ * Wait until request_rate allows one more request. The token bucket is
+ * kept as the time it is empty until, each request reserves its token
+ * under the lock then sleeps outside of it, so that concurrent requests
+ * are spaced by 1 / request_rate after the first request_burst ones.
+ *
+ * @return the time waited, in us
+ */
+static int64_t rate_wait(WMSContext *s)
+{
+    int64_t now, interval, tat, delay;
+
+    if (!s->request_rate)
+        return 0;
+    interval = llrint(1000000 / s->request_rate);
+    ff_mutex_lock(&s->rate_lock);
+    now   = av_gettime_relative();
+    tat   = FFMAX(s->rate_tat, now);
+    delay = FFMAX(tat - now - (s->request_burst - 1) * interval, 0);
+    s->rate_tat = tat + interval;
+    ff_mutex_unlock(&s->rate_lock);
+    if (delay)
+        av_usleep(delay);
+    return delay;
+}
+
+static const char *const stat_names[WMS_STAT_NB] = {
+    [WMS_STAT_QUEUE]    = "queue_wait",
+    [WMS_STAT_THROTTLE] = "throttle_delay",
+    [WMS_STAT_CONC]     = "concurrency_wait",
+    [WMS_STAT_TTFB]     = "ttfb",
+    [WMS_STAT_TRANSFER] = "transfer",
+    [WMS_STAT_DECODE]   = "decode",
+    [WMS_STAT_FETCH]    = "fetch_time",
+};
+
+/**
+ * Sum the stats of frames, or of the requests of a frame
+ */
+static void stats_sum(WMSFrameStats *dst, const WMSFrameStats *src)
+{
+    for (int i = 0; i < WMS_STAT_NB; i++)
+        dst->time[i] += src->time[i];
+    dst->bytes           += src->bytes;
+    dst->requests        += src->requests;
+    dst->new_conns       += src->new_conns;
+    dst->disk_hits       += src->disk_hits;
+    dst->revalidated     += src->revalidated;
+    dst->shm_hits        += src->shm_hits;
+    dst->shared_hits     += src->shared_hits;
+    dst->frame_cache_hit += src->frame_cache_hit;
+}
+
+/**
+ * Add the stats of a sub-request to the ones of its frame
+ */
+static void stats_add(WMSFrameStats *dst, const WMSFrameStats *src)
+{
+    int64_t throttle = dst->time[WMS_STAT_THROTTLE];
+    int hit = dst->frame_cache_hit;
+
+    stats_sum(dst, src);
+    // Throttled requests of a frame wait for each other
+    dst->time[WMS_STAT_THROTTLE] = FFMAX(throttle, src->time[WMS_STAT_THROTTLE]);
+    dst->frame_cache_hit = hit | src->frame_cache_hit;
+}
+
+/**
+ * Merge the stats of a pool job into the ones of its frame
+ */
+static void stats_merge(WMSContext *s, WMSFrameStats *dst, const WMSFrameStats *src)
+{
+    ff_mutex_lock(&s->lock);
+    stats_add(dst, src);
+    ff_mutex_unlock(&s->lock);
+}
+
+static void stats_export(AVDictionary **metadata, const WMSFrameStats *st)
+{
+    for (int i = 0; i < WMS_STAT_NB; i++) {
+        char key[64], buf[32];
+        snprintf(key, sizeof(key), "lavfi.wms.%s", stat_names[i]);
+        snprintf(buf, sizeof(buf), "%f", st->time[i] / 1000000.0);
+        av_dict_set(metadata, key, buf, 0);
+    }
+    av_dict_set_int(metadata, "lavfi.wms.bytes",           st->bytes, 0);
+    av_dict_set_int(metadata, "lavfi.wms.requests",        st->requests, 0);
+    av_dict_set_int(metadata, "lavfi.wms.new_connections", st->new_conns, 0);
+    av_dict_set_int(metadata, "lavfi.wms.disk_cache_hits", st->disk_hits, 0);
+    av_dict_set_int(metadata, "lavfi.wms.revalidated",     st->revalidated, 0);
+    av_dict_set_int(metadata, "lavfi.wms.shm_cache_hits",  st->shm_hits, 0);
+    av_dict_set_int(metadata, "lavfi.wms.shared_hits",     st->shared_hits, 0);
+    av_dict_set_int(metadata, "lavfi.wms.frame_cache_hit", st->frame_cache_hit, 0);
+}
+
+static void stats_account(WMSContext *s, const WMSFrameStats *st)
+{
+    for (int i = 0; i < WMS_STAT_NB; i++) {
+        WMSHistogram *h = &s->hist[i];
+        int64_t t = FFMAX(st->time[i], 0);
+        h->bins[FFMIN(av_log2(t | 1), WMS_HIST_BINS - 1)]++;
+        h->sum += t;
+        h->max  = FFMAX(h->max, t);
+    }
+    stats_sum(&s->total, st);
+    s->nb_frames++;
+}
+
+/**
+ * @return upper bound of the bin holding quantile q of h, in us
+ */
+static int64_t hist_quantile(const WMSHistogram *h, int64_t count, double q)
+{
+    int64_t n = 0;
+
+    for (int i = 0; i < WMS_HIST_BINS; i++) {
+        n += h->bins[i];
+        if (n >= q * count)
+            return FFMIN(2LL << i, h->max);
+    }
+    return h->max;
+}
+
+static void stats_log(AVFilterContext *ctx, int level)
+{
+    WMSContext *s = ctx->priv;
+    const WMSFrameStats *t = &s->total;
+
+    if (!s->nb_frames)
+        return;
+    av_log(ctx, level, "%"PRId64" frames, %d requests, %d new connections, %"PRId64" bytes, "
+           "%d disk cache hits, %d revalidated, %d shm cache hits, %d shared hits, %d frame cache hits\n",
+           s->nb_frames, t->requests, t->new_conns, t->bytes,
+           t->disk_hits, t->revalidated, t->shm_hits, t->shared_hits, t->frame_cache_hit);
+    for (int i = 0; i < WMS_STAT_NB; i++) {
+        const WMSHistogram *h = &s->hist[i];
+        av_log(ctx, level, "%-16s mean %8.3f ms  p50 %8.3f ms  p90 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n",
+               stat_names[i], h->sum / 1000.0 / s->nb_frames,
+               hist_quantile(h, s->nb_frames, 0.5) / 1000.0,
+               hist_quantile(h, s->nb_frames, 0.9) / 1000.0,
+               hist_quantile(h, s->nb_frames, 0.99) / 1000.0, h->max / 1000.0);
+    }
+}
+
+static int stats_write(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    const WMSFrameStats *t = &s->total;
+    AVBPrint bp;
+    FILE *f;
+    int ret = 0;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&bp, "{\n  \"frames\": %"PRId64",\n  \"requests\": %d,\n  \"new_connections\": %d,\n"
+               "  \"bytes\": %"PRId64",\n  \"disk_cache_hits\": %d,\n  \"revalidated\": %d,\n"
+               "  \"shm_cache_hits\": %d,\n  \"shared_hits\": %d,\n  \"frame_cache_hits\": %d,\n"
+               "  \"times\": {\n",
+               s->nb_frames, t->requests, t->new_conns, t->bytes,
+               t->disk_hits, t->revalidated, t->shm_hits, t->shared_hits, t->frame_cache_hit);
+    for (int i = 0; i < WMS_STAT_NB; i++) {
+        const WMSHistogram *h = &s->hist[i];
+        int last = WMS_HIST_BINS - 1;
+
+        while (last > 0 && !h->bins[last])
+            last--;
+        av_bprintf(&bp, "    \"%s\": { \"sum_us\": %"PRId64", \"max_us\": %"PRId64", \"log2_us_bins\": [",
+                   stat_names[i], h->sum, h->max);
+        for (int j = 0; j <= last; j++)
+            av_bprintf(&bp, "%s%"PRIu64, j ? ", " : "", h->bins[j]);
+        av_bprintf(&bp, "] }%s\n", i < WMS_STAT_NB - 1 ? "," : "");
+    }
+    av_bprintf(&bp, "  }\n}\n");
+
+    if (!av_bprint_is_complete(&bp))
+        ret = AVERROR(ENOMEM);
+    else if (!(f = avpriv_fopen_utf8(s->stats_file, "w")))
+        ret = AVERROR(errno);
+    else {
+        if (fwrite(bp.str, 1, bp.len, f) != bp.len)
+            ret = AVERROR(EIO);
+        if (fclose(f))
+            ret = AVERROR(errno);
+    }
+    if (ret < 0)
+        av_log(ctx, AV_LOG_ERROR, "Could not write stats to '%s': %s\n",
+               s->stats_file, av_err2str(ret));
+    av_bprint_finalize(&bp, NULL);
+    return ret;
+}
+
+/**
+ * Fetch and parse GetCapabilities, conditionally on the validators in v,
+ * which are replaced by the ones of the response.
+ *
+ * @return 1 if the capabilities were not modified, else 0 or a negative
+ * error code
+ */
+static int read_xml(AVFilterContext *ctx, WMSValidators *v) {
+    WMSContext *s = ctx->priv;
+    AVIOContext *io_ctx = NULL;
+    AVDictionary *opts = NULL;
+    int ret;
+    char *url = prepare_capabilities_url(s->capabilities_url);
+
+    if (!url)
+        return AVERROR(ENOMEM);
+    set_validators(&opts, v->etag, v->last_modified);
+    if (s->timeout)
+        av_dict_set_int(&opts, "timeout", s->timeout, 0);
+    rate_wait(s);
+    ret = avio_open2(&io_ctx, url, AVIO_FLAG_READ, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        av_log(ctx, AV_LOG_ERROR, "Error opening GetCapabilities URL: %s\n", av_err2str(ret));
+        goto end;
+    }
+
+    get_validators(io_ctx, v);
+    if (not_modified(io_ctx)) {
+        ret = 1;
+        goto end;
+    }
+    caps_reset(s);
+    ret = parse_xml(io_ctx, url, ctx);
+end:
+    avio_close(io_ctx);
+    av_free(url);
+    xmlCleanupParser();
+    return ret;
+}
+
+#define WMS_REQARG_SERVICE "service=%s"
+#define WMS_REQARG_VERSION "version=%s"
+#define WMS_REQARG_REQUEST "request=%s"
+#define WMS_REQARG_LAYERS "layers=%s"
+#define WMS_REQARG_STYLES "styles=%s"
+#define WMS_REQARG_FORMAT "format=%s"
+#define WMS_REQARG_BBOX "bbox=%%lf,%%lf,%%lf,%%lf"
+#define WMS_REQARG_WIDTH "width=%%d"
+#define WMS_REQARG_HEIGHT "height=%%d"
+#define WMS_REQARG_SRS "srs=%s"
+#define WMS_REQARG_CRS "crs=%s"
+#define WMS_REQARG_TRANSPARENT "transparent=TRUE"
+
+#define WMS_1_1_X_REQARGS "%s?" \
+    WMS_REQARG_SERVICE "&" WMS_REQARG_VERSION "&" WMS_REQARG_REQUEST "&" \
+    WMS_REQARG_LAYERS "&" WMS_REQARG_STYLES "&" WMS_REQARG_FORMAT "&" \
+    WMS_REQARG_BBOX "&" WMS_REQARG_WIDTH "&" WMS_REQARG_HEIGHT "&" \
+    WMS_REQARG_SRS
+
+#define WMS_1_3_0_REQARGS "%s?" \
+    WMS_REQARG_SERVICE "&" WMS_REQARG_VERSION "&" WMS_REQARG_REQUEST "&" \
+    WMS_REQARG_LAYERS "&" WMS_REQARG_STYLES "&" WMS_REQARG_FORMAT "&" \
+    WMS_REQARG_BBOX "&" WMS_REQARG_WIDTH "&" WMS_REQARG_HEIGHT "&" \
+    WMS_REQARG_CRS
+
+static int init_version(AVFilterContext *ctx) {
+    WMSContext *s = ctx->priv;
+    if(strcmp(s->version, "1.3.0") == 0) {
+        s->wms_version = WMS_V1_3_0;
+        return 0;
+    }
+    if(strcmp(s->version, "1.1.1") == 0) {
+        s->wms_version = WMS_V1_1_1;
+        return 0;
+    }
+    if(strcmp(s->version, "1.1.0") == 0) {
+        s->wms_version = WMS_V1_1_0;
+        return 0;
+    }
+
+    av_log(ctx, AV_LOG_ERROR,
+           "WMS version '%s' not implemented. Available versions are '1.0.0' , '1.1.0', '1.1.1' and '1.3.0'\n",
+           s->version);
+
+    return AVERROR(EINVAL);
+
+}
+
+static char* format_url_arg(char* raw_arg) {
+    #define NONEED_ESCAPE(ch) \
+        (ch >='a' && ch <= 'z') || (ch >='A' && ch <= 'Z') || \
+        (ch >='-' && ch <= '9' && ch != '/') ||(ch == '~' || ch == '_')
+
+    int dst_i = 0;
+    int ret;
+    int result_size = 1;
+    char* dst;
+    char c;
+    for (int i=0; (c=raw_arg[i]) != 0; i++) {
+        if (NONEED_ESCAPE(c)) {
+            result_size++;
+        }else {
+            result_size += 4;
+        }
+    }
+
+    dst = av_malloc(result_size);
+    dst[0] = 0;
+
+    for (int i=0; (c=raw_arg[i]) != 0; i++) {
+        if (NONEED_ESCAPE(c)) {
+            dst[dst_i] = c;
+            dst_i++;
+            dst[dst_i] = '\0';
+        }else {
+            // adds %%xx instead of special char
+            ret = snprintf(&dst[dst_i], 5, "%%%%%02X", (uint8_t)c);
+            if (ret < 0) return NULL;
+            if(ret < 4){ dst_i += ret; }else{ dst_i += 4; }
+        }
+    }
+    return dst;
+}
+
+#define WMS_REQVAL_REQUEST "GetMap"
+#define WMS_REQVAL_STYLES ""
+#define WMS_REQVAL_PROJ "EPSG:4326"
+
+typedef struct WMSPlaceholder {
+    const char *name;
+    const char *value;
+    int literal;        ///< value is text, else a conversion of the tile arguments
+} WMSPlaceholder;
+
+/**
+ * Turn a tile URL template into a format taking the tile matrix identifier,
+ * the column and the row. Each of them must appear in the template.
+ */
+static int tile_url_format(AVFilterContext *ctx, char **fmt, const char *tmpl,
+                           const WMSPlaceholder *ph, int nb_ph)
+{
+    unsigned used = 0, needed = 0;
+    AVBPrint bp;
+    int ret;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    for (int i = 0; i < nb_ph; i++)
+        needed |= !ph[i].literal << i;
+    while (*tmpl) {
+        size_t len;
+        int i;
+
+        if (*tmpl != '{') {
+            av_bprint_chars(&bp, *tmpl, 1 + (*tmpl == '%'));
+            tmpl++;
+            continue;
+        }
+        len = strcspn(tmpl + 1, "}");
+        for (i = 0; i < nb_ph; i++)
+            if (strlen(ph[i].name) == len && !strncmp(tmpl + 1, ph[i].name, len))
+                break;
+        if (i == nb_ph || !tmpl[len + 1]) {
+            av_log(ctx, AV_LOG_ERROR, "Unsupported placeholder '%.*s' in tile URL\n",
+                   (int)FFMIN(len + 2, INT_MAX), tmpl);
+            av_bprint_finalize(&bp, NULL);
+            return AVERROR(EINVAL);
+        }
+        if (ph[i].literal) {
+            for (const char *c = ph[i].value; *c; c++)
+                av_bprint_chars(&bp, *c, 1 + (*c == '%'));
+        } else {
+            av_bprintf(&bp, "%s", ph[i].value);
+        }
+        used |= 1 << i;
+        tmpl += len + 2;
+    }
+    if ((used & needed) != needed) {
+        av_log(ctx, AV_LOG_ERROR, "Tile URL must contain all of");
+        for (int i = 0; i < nb_ph; i++)
+            if (!ph[i].literal)
+                av_log(ctx, AV_LOG_ERROR, " {%s}", ph[i].name);
+        av_log(ctx, AV_LOG_ERROR, "\n");
+        av_bprint_finalize(&bp, NULL);
+        return AVERROR(EINVAL);
+    }
+    if ((ret = av_bprint_finalize(&bp, fmt)) < 0)
+        return ret;
+    av_log(ctx, AV_LOG_DEBUG, "Tile URL format: %s\n", *fmt);
+    return 0;
+}
+
+/**
+ * XYZ tiles: the Web Mercator pyramid of 2^z x 2^z square tiles at zoom z
+ */
+static int init_xyz(AVFilterContext *ctx)
+{
+    static const WMSPlaceholder ph[] = {
+        { "z", "%1$s" }, { "x", "%2$"PRId64 }, { "y", "%3$"PRId64 },
+    };
+    WMSContext *s = ctx->priv;
+    int tile_size = s->tile_size ? s->tile_size : 256;
+    int ret;
+
+    if ((ret = tile_url_format(ctx, &s->fmt_url, s->capabilities_url + 1, ph, FF_ARRAY_ELEMS(ph))) < 0)
+        return ret;
+    s->nb_matrices = s->max_zoom + 1;
+    if (!(s->matrices = av_calloc(s->nb_matrices, sizeof(*s->matrices))))
+        return AVERROR(ENOMEM);
+    for (int z = 0; z < s->nb_matrices; z++) {
+        WMSTileMatrix *tm = &s->matrices[z];
+        snprintf(tm->id, sizeof(tm->id), "%d", z);
+        tm->res    = 2 * WMS_MERCATOR_MAX / tile_size / (1LL << z);
+        tm->x0     = -WMS_MERCATOR_MAX;
+        tm->y0     =  WMS_MERCATOR_MAX;
+        tm->tile_w = tm->tile_h = tile_size;
+        tm->cols   = tm->rows   = 1LL << z;
+    }
+    s->tile_service = WMS_TILES_XYZ;
+    return 0;
+}
+
+static int init_wmts(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    const WMSPlaceholder ph[] = {
+        { "TileMatrix", "%1$s" }, { "TileCol", "%2$"PRId64 }, { "TileRow", "%3$"PRId64 },
+        { "Style", s->tile_style, 1 }, { "TileMatrixSet", s->tile_matrix_set, 1 },
+    };
+
+    return tile_url_format(ctx, &s->fmt_url, s->url, ph, FF_ARRAY_ELEMS(ph));
+}
+
+/**
+ *
+ * @return -1 if an error occurs, 0 if format has been forced, else 1
+ */
+static int init_format_force(AVFilterContext *ctx){
+    char *src_c, *dst_c;
+    uint8_t force_flag;
+    int url_length;
+    WMSContext *s = ctx->priv;
+
+    if( s->capabilities_url == NULL ){
+        av_log(ctx, AV_LOG_ERROR, "'url' is needed\n" );
+        return -1;
+    }
+    if (s->capabilities_url[0] == '%' && strstr(s->capabilities_url, "{z}"))
+        return init_xyz(ctx);
+    if(s->capabilities_url[0] == '%'){
+        force_flag = 0;
+        url_length = 1;
+        for(src_c = s->capabilities_url+1; *src_c != 0; src_c++){
+            url_length++;
+            if (*src_c == '%' || *src_c == '{') url_length++;
+        }
+        s->fmt_url = av_malloc(url_length++);
+        src_c = 1+s->capabilities_url;
+        dst_c = s->fmt_url;
+        while( *src_c != '\0' ){
+            *dst_c = *src_c;
+            // Repeat %
+            if(*src_c == '%'){
+                dst_c++;
+                *dst_c = *src_c;
+            }
+            #define WMS_FORCEURL_X1FLAG (1<<0)
+            #define WMS_FORCEURL_Y1FLAG (1<<1)
+            #define WMS_FORCEURL_X2FLAG (1<<2)
+            #define WMS_FORCEURL_Y2FLAG (1<<3)
+
+            if(*src_c == '{'){
+                if(strncmp(src_c,"{x1}",4) == 0){
+                    memcpy(dst_c, "%1$lf", 5); src_c += 3; dst_c += 4;
                     force_flag |= WMS_FORCEURL_X1FLAG;
                 }
                 if(strncmp(src_c,"{y1}",4) == 0){
@@ -343,177 +1426,3291 @@ static int init_format_force(AVFilterContext *ctx){
                     memcpy(dst_c, "%4$lf", 5); src_c += 3; dst_c += 4;
                     force_flag |= WMS_FORCEURL_Y2FLAG;
                 }
+                if(strncmp(src_c,"{width}",7) == 0){
+                    memcpy(dst_c, "%5$d", 4); src_c += 6; dst_c += 3;
+                }
+                if(strncmp(src_c,"{height}",8) == 0){
+                    memcpy(dst_c, "%6$d", 4); src_c += 7; dst_c += 3;
+                }
+            }
+            src_c++;
+            dst_c++;
+        }
+        *dst_c = *src_c;
+        if (force_flag !=  15){
+            av_log(ctx, AV_LOG_ERROR, "Forced URL should contain '{x1}', '{y1}', '{x2}' and '{y2}'\n" );
+            return -1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Build a GetMap URL format from already escaped arguments
+ */
+static char *getmap_url_format(const WMSContext *s, const char *service,
+                               const char *layers, const char *format, int transparent)
+{
+    char *fmt, *tmp;
+
+    switch (s->wms_version) {
+        case WMS_V1_3_0:
+            fmt = av_asprintf(WMS_1_3_0_REQARGS, s->url,
+                service, s->version, WMS_REQVAL_REQUEST,
+                layers, WMS_REQVAL_STYLES, format,
+                WMS_REQVAL_PROJ
+                );
+            break;
+        default:
+            fmt = av_asprintf(WMS_1_1_X_REQARGS, s->url,
+                service, s->version, WMS_REQVAL_REQUEST,
+                layers, WMS_REQVAL_STYLES, format,
+                WMS_REQVAL_PROJ
+                );
+            break;
+    }
+    if (!fmt || !transparent)
+        return fmt;
+    tmp = av_asprintf("%s&" WMS_REQARG_TRANSPARENT, fmt);
+    av_free(fmt);
+    return tmp;
+}
+
+/**
+ * One GetMap URL format per requested layer. All but the bottom layer are
+ * requested transparent, so that they can be composited over it.
+ */
+static int init_split_layers(AVFilterContext *ctx, const char *service, const char *format)
+{
+    WMSContext *s = ctx->priv;
+    int nb = count_layers(s->layers);
+    const char *p = s->layers;
+
+    if (nb < 2)
+        return 0;
+    if (s->pix_fmt != AV_PIX_FMT_RGBA) {
+        av_log(ctx, AV_LOG_ERROR, "split_layers needs a format with transparency\n");
+        return AVERROR(EINVAL);
+    }
+    s->layer_fmts    = av_calloc(nb, sizeof(*s->layer_fmts));
+    s->layer_dynamic = av_calloc(nb, sizeof(*s->layer_dynamic));
+    s->layer_dims    = av_calloc(nb, sizeof(*s->layer_dims));
+    if (!s->layer_fmts || !s->layer_dynamic || !s->layer_dims)
+        return AVERROR(ENOMEM);
+    while (*p) {
+        size_t n = strcspn(p, ",");
+
+        if (n) {
+            int i = s->nb_split_layers;
+            char *name = av_strndup(p, n), *layer = name ? format_url_arg(name) : NULL;
+
+            if (layer)
+                s->layer_fmts[i] = getmap_url_format(s, service, layer, format, i > 0);
+            s->layer_dynamic[i] = name && s->dynamic_layers &&
+                                  layer_requested(s->dynamic_layers, name);
+            s->nb_dynamic_layers += s->layer_dynamic[i];
+            for (int d = 0; name && d < WMS_DIM_NB; d++)
+                if (s->dim_layers[d] && layer_requested(s->dim_layers[d], name))
+                    s->layer_dims[i] |= 1 << d;
+            av_free(layer);
+            av_free(name);
+            if (!s->layer_fmts[i])
+                return AVERROR(ENOMEM);
+            av_log(ctx, AV_LOG_DEBUG, "Layer %d URL format: %s\n", i, s->layer_fmts[i]);
+            s->nb_split_layers++;
+        }
+        p += n + !!p[n];
+    }
+    return 0;
+}
+
+static int init_format(AVFilterContext *ctx) {
+    WMSContext *s = ctx->priv;
+
+    int ret;
+    //Needs escaping: service , layers
+    char *service = format_url_arg(s->service);
+    char *layers = format_url_arg(s->layers);
+    char *format = format_url_arg(s->format);
+
+    if (service == NULL) {
+        av_log(ctx, AV_LOG_ERROR,
+       "Could not escape 'service' URL param\n");
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+
+    if (layers == NULL) {
+        av_log(ctx, AV_LOG_ERROR,
+    "Could not escape 'layers' arg for URL\n");
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+
+    if (format == NULL) {
+        av_log(ctx, AV_LOG_ERROR,
+    "Could not escape 'format' arg for URL\n");
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+
+    s->fmt_url = getmap_url_format(s, service, layers, format, 0);
+
+    if (!s->fmt_url || strlen(s->fmt_url) <= 0) {
+        av_log(ctx, AV_LOG_ERROR,
+       "Could not build URL\n");
+        ret = AVERROR(EIO);
+        goto fail;
+    }
+    av_log(ctx, AV_LOG_DEBUG,"WMS URL format: %s", s->fmt_url);
+    ret = s->split_layers ? init_split_layers(ctx, service, format) : 0;
+fail:
+    av_free(service);
+    av_free(layers);
+    av_free(format);
+    return ret;
+}
+
+static const char *const var_names[] = {
+    "xref", "yref", //reference
+    "x1","x2","y1","y2", //bbox
+    "t", //time
+    NULL
+};
+
+enum var_name {
+    VAR_XREF,
+    VAR_YREF,
+    VAR_X1,
+    VAR_X2,
+    VAR_Y1,
+    VAR_Y2,
+    VAR_T,
+    VARS_NB
+};
+
+static av_cold int init_expressions(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    const char *exprs[VAR_T] = {
+        [VAR_XREF] = s->xref_expr, [VAR_YREF] = s->yref_expr,
+        [VAR_X1]   = s->x1_expr,   [VAR_X2]   = s->x2_expr,
+        [VAR_Y1]   = s->y1_expr,   [VAR_Y2]   = s->y2_expr,
+    };
+    int ret;
+
+    for (int i = 0; i < VAR_T; i++) {
+        if ((ret = av_expr_parse(&s->exprs[i], exprs[i], var_names,
+                                 NULL, NULL, NULL, NULL, 0, ctx)) < 0) {
+            av_log(ctx, AV_LOG_ERROR,
+                   "Error when parsing the expression '%s'.\n",
+                   exprs[i]);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Evaluate the bbox of nb_frames consecutive frames, starting at pts.
+ * Each expression can use the ones evaluated before it.
+ */
+static void eval_bboxes(WMSContext *s, MapReadContext *maps, uint64_t pts,
+                        int nb_frames, AVRational time_base)
+{
+    double var_values[VARS_NB];
+
+    for (int n = 0; n < nb_frames; n++) {
+        for (int i = 0; i < VAR_T; i++)
+            var_values[i] = NAN;
+        var_values[VAR_T] = (pts + n) * av_q2d(time_base);
+        for (int i = 0; i < VAR_T; i++)
+            var_values[i] = av_expr_eval(s->exprs[i], var_values, NULL);
+        maps[n] = (MapReadContext){ var_values[VAR_X1], var_values[VAR_Y1],
+                                    var_values[VAR_X2], var_values[VAR_Y2] };
+    }
+}
+
+/*
+ * Dimensions: the TIME and ELEVATION expressions are evaluated per frame and
+ * snapped to the closest value advertised in GetCapabilities, which lists
+ * values and min/max/resolution intervals, comma separated.
+ */
+static const char *const dim_var_names[] = {
+    "t",        ///< time of the frame, in seconds
+    "n",        ///< number of the frame
+    "min",      ///< lowest advertised value
+    "max",      ///< highest advertised value
+    NULL
+};
+
+enum { DIM_VAR_T, DIM_VAR_N, DIM_VAR_MIN, DIM_VAR_MAX, DIM_VARS_NB };
+
+#define WMS_MONTH (365.2425 * 86400 / 12) ///< average length of a month, in seconds
+
+/**
+ * Parse an ISO 8601 time, UTC unless an offset is given. The reduced
+ * precisions WMS allows are accepted: 2024, 2024-05, 2024-05-01T12Z...
+ */
+static int parse_iso_time(const char *str, double *t)
+{
+    static const char *const date_fmt[] = { "%Y-%m-%d", "%Y-%m", "%Y" };
+    static const char *const time_fmt[] = { "%H:%M:%S", "%H:%M", "%H" };
+    struct tm tm = { .tm_mday = 1 };
+    const char *p = NULL;
+    double frac = 0;
+    int offset = 0;
+
+    if (!av_strcasecmp(str, "current") || !av_strcasecmp(str, "present")) {
+        *t = av_gettime() / 1000000.0;
+        return 0;
+    }
+    for (int i = 0; i < FF_ARRAY_ELEMS(date_fmt) && !p; i++)
+        p = av_small_strptime(str, date_fmt[i], &tm);
+    if (p && (*p == 'T' || *p == 't')) {
+        const char *q = NULL;
+        for (int i = 0; i < FF_ARRAY_ELEMS(time_fmt) && !q; i++)
+            q = av_small_strptime(p + 1, time_fmt[i], &tm);
+        if ((p = q) && *p == '.') {
+            char *end;
+            frac = strtod(p, &end);
+            p = end;
+        }
+    }
+    if (p && (*p == 'Z' || *p == 'z')) {
+        p++;
+    } else if (p && (*p == '+' || *p == '-')) {
+        struct tm tz = { 0 };
+        int sign = *p == '+' ? -1 : 1;
+        const char *q = NULL;
+        for (int i = 1; i < FF_ARRAY_ELEMS(time_fmt) && !q; i++)
+            q = av_small_strptime(p + 1, time_fmt[i], &tz);
+        offset = sign * (tz.tm_hour * 60 + tz.tm_min) * 60;
+        p = q;
+    }
+    if (!p || *p)
+        return AVERROR(EINVAL);
+    *t = av_timegm(&tm) + offset + frac;
+    return 0;
+}
+
+/**
+ * Parse an ISO 8601 duration, PnYnMnDTnHnMnS or PnW
+ */
+static int parse_iso_duration(const char *str, WMSDimRange *r)
+{
+    int in_time = 0;
+
+    if (*str++ != 'P' || !*str)
+        return AVERROR(EINVAL);
+    while (*str) {
+        char *end;
+        double v;
+
+        if (*str == 'T' && !in_time) {
+            in_time = 1;
+            str++;
+            continue;
+        }
+        v = strtod(str, &end);
+        if (end == str || v < 0)
+            return AVERROR(EINVAL);
+        // Years and months have no fixed length, they are counted apart
+        if (!in_time && (*end == 'Y' || *end == 'M') && v != floor(v))
+            return AVERROR(EINVAL);
+        if      (!in_time && *end == 'Y') r->months += 12 * v;
+        else if (!in_time && *end == 'M') r->months += v;
+        else if (!in_time && *end == 'W') r->step   += v * 604800;
+        else if (!in_time && *end == 'D') r->step   += v * 86400;
+        else if ( in_time && *end == 'H') r->step   += v * 3600;
+        else if ( in_time && *end == 'M') r->step   += v * 60;
+        else if ( in_time && *end == 'S') r->step   += v;
+        else
+            return AVERROR(EINVAL);
+        str = end + 1;
+    }
+    return 0;
+}
+
+static int parse_dim_value(int d, const char *str, double *v)
+{
+    char *end;
+
+    if (d == WMS_DIM_TIME)
+        return parse_iso_time(str, v);
+    *v = av_strtod(str, &end);
+    return end > str && !*end ? 0 : AVERROR(EINVAL);
+}
+
+static int parse_dim_range(int d, char *str, WMSDimRange *r)
+{
+    char *saveptr = NULL, *start = av_strtok(str, "/", &saveptr);
+    char *end  = av_strtok(NULL, "/", &saveptr);
+    char *step = av_strtok(NULL, "/", &saveptr);
+    int ret;
+
+    if (!start || av_strtok(NULL, "/", &saveptr))
+        return AVERROR(EINVAL);
+    if ((ret = parse_dim_value(d, start, &r->start)) < 0)
+        return ret;
+    if (!end) {
+        r->end = r->start;
+        return 0;
+    }
+    if ((ret = parse_dim_value(d, end, &r->end)) < 0)
+        return ret;
+    if (step && (ret = d == WMS_DIM_TIME ? parse_iso_duration(step, r) :
+                       parse_dim_value(d, step, &r->step)) < 0)
+        return ret;
+    return r->end >= r->start && r->step >= 0 ? 0 : AVERROR(EINVAL);
+}
+
+static av_cold int init_dimension(AVFilterContext *ctx, int d)
+{
+    WMSContext *s = ctx->priv;
+    char *values = av_strdup(s->dim_values[d]), *saveptr = NULL, *item;
+    int ret = 0;
+
+    if (!values)
+        return AVERROR(ENOMEM);
+    s->dim_min[d] = INFINITY;
+    s->dim_max[d] = -INFINITY;
+    for (item = av_strtok(values, ",", &saveptr); item; item = av_strtok(NULL, ",", &saveptr)) {
+        WMSDimRange r = { 0 }, *ranges;
+        char *str = av_strdup(item);
+
+        if (!str) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        ret = parse_dim_range(d, str, &r);
+        av_free(str);
+        if (ret < 0) {
+            av_log(ctx, AV_LOG_ERROR, "Invalid %s value '%s' in GetCapabilities\n",
+                   dim_names[d], item);
+            break;
+        }
+        ranges = av_realloc_array(s->dim_ranges[d], s->nb_dim_ranges[d] + 1, sizeof(*ranges));
+        if (!ranges) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        s->dim_ranges[d] = ranges;
+        ranges[s->nb_dim_ranges[d]++] = r;
+        s->dim_min[d] = FFMIN(s->dim_min[d], r.start);
+        s->dim_max[d] = FFMAX(s->dim_max[d], r.end);
+    }
+    av_free(values);
+    if (!ret && !s->nb_dim_ranges[d]) {
+        av_log(ctx, AV_LOG_ERROR, "No %s value in GetCapabilities\n", dim_names[d]);
+        ret = AVERROR(EINVAL);
+    }
+    return ret;
+}
+
+static av_cold int init_dimensions(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    const char *exprs[WMS_DIM_NB] = { s->time_expr, s->elevation_expr };
+    int ret;
+
+    for (int d = 0; d < WMS_DIM_NB; d++) {
+        if (!exprs[d])
+            continue;
+        // Values are validated against the capabilities
+        if (!s->service || s->tile_service) {
+            av_log(ctx, AV_LOG_ERROR, "%s needs the GetCapabilities of a WMS\n", dim_names[d]);
+            return AVERROR(EINVAL);
+        }
+        if (!s->dim_values[d]) {
+            av_log(ctx, AV_LOG_ERROR, "None of the requested layers has a %s dimension\n",
+                   dim_names[d]);
+            return AVERROR(EINVAL);
+        }
+        if ((ret = av_expr_parse(&s->dim_exprs[d], exprs[d], dim_var_names,
+                                 NULL, NULL, NULL, NULL, 0, ctx)) < 0) {
+            av_log(ctx, AV_LOG_ERROR, "Error when parsing the expression '%s'.\n", exprs[d]);
+            return ret;
+        }
+        if ((ret = init_dimension(ctx, d)) < 0)
+            return ret;
+        av_log(ctx, AV_LOG_VERBOSE, "Animating %s over %s\n", dim_names[d], s->dim_values[d]);
+        s->nb_dims++;
+    }
+    return 0;
+}
+
+/**
+ * Value number k of range r
+ */
+static double dim_range_value(const WMSDimRange *r, int64_t k)
+{
+    double v = r->start;
+
+    if (r->months) {
+        time_t sec = floor(r->start);
+        struct tm tmbuf, *tm = gmtime_r(&sec, &tmbuf);
+        int64_t month;
+
+        if (!tm)
+            return NAN;
+        month = tm->tm_year * 12LL + tm->tm_mon + k * r->months;
+        tm->tm_year = floor(month / 12.0);
+        tm->tm_mon  = month - tm->tm_year * 12LL;
+        v = av_timegm(tm) + (r->start - sec);
+    }
+    return v + k * r->step;
+}
+
+/**
+ * Closest value of dimension d to v
+ */
+static double snap_dimension(const WMSContext *s, int d, double v)
+{
+    double best = NAN;
+
+    for (int i = 0; i < s->nb_dim_ranges[d]; i++) {
+        const WMSDimRange *r = &s->dim_ranges[d][i];
+        double c = av_clipd(v, r->start, r->end);
+
+        if (r->months || r->step) {
+            // Months differ in length, look around the estimated value
+            int64_t k = llrint((c - r->start) / (r->months * WMS_MONTH + r->step));
+            double x, near = r->start;
+
+            for (int64_t j = FFMAX(k - 1, 1); j <= k + 1; j++)
+                if ((x = dim_range_value(r, j)) <= r->end && fabs(x - c) < fabs(near - c))
+                    near = x;
+            c = near;
+        }
+        if (isnan(best) || fabs(c - v) < fabs(best - v))
+            best = c;
+    }
+    return best;
+}
+
+/**
+ * Evaluate the dimensions of the frame of slot into its query parameters
+ */
+static void prepare_dimensions(WMSContext *s, WMSSlot *slot, AVRational time_base)
+{
+    double var_values[DIM_VARS_NB];
+
+    for (int d = 0; d < WMS_DIM_NB; d++) {
+        double v;
+
+        slot->dims[d][0] = 0;
+        if (!s->dim_exprs[d])
+            continue;
+        var_values[DIM_VAR_T]   = slot->pts * av_q2d(time_base);
+        var_values[DIM_VAR_N]   = slot->pts;
+        var_values[DIM_VAR_MIN] = s->dim_min[d];
+        var_values[DIM_VAR_MAX] = s->dim_max[d];
+        // Let the server use its default value
+        if (isnan(v = av_expr_eval(s->dim_exprs[d], var_values, NULL)))
+            continue;
+        if ((v < s->dim_min[d] || v > s->dim_max[d]) && !(s->dim_warned & (1 << d))) {
+            av_log(s, AV_LOG_WARNING, "%s is out of the advertised values, using the closest one\n",
+                   dim_names[d]);
+            s->dim_warned |= 1 << d;
+        }
+        v = snap_dimension(s, d, v);
+        if (d == WMS_DIM_TIME) {
+            time_t sec = floor(v);
+            int ms = lrint((v - sec) * 1000);
+            struct tm tmbuf, *tm;
+            size_t len;
+
+            if (ms == 1000) {
+                sec++;
+                ms = 0;
+            }
+            if (!(tm = gmtime_r(&sec, &tmbuf)))
+                continue;
+            len = strftime(slot->dims[d], sizeof(slot->dims[d]), "&time=%Y-%m-%dT%H:%M:%S", tm);
+            if (ms)
+                snprintf(slot->dims[d] + len, sizeof(slot->dims[d]) - len, ".%03dZ", ms);
+            else
+                av_strlcat(slot->dims[d], "Z", sizeof(slot->dims[d]));
+        } else {
+            snprintf(slot->dims[d], sizeof(slot->dims[d]), "&%s=%.15g", dim_names[d], v);
+        }
+    }
+}
+
+/**
+ * Query parameters of the dimensions of slot in mask, 1 << WMSDim flags
+ */
+static void dims_query(char *buf, size_t size, const WMSSlot *slot, unsigned mask)
+{
+    buf[0] = 0;
+    for (int d = 0; d < WMS_DIM_NB; d++)
+        if (mask & (1 << d))
+            av_strlcat(buf, slot->dims[d], size);
+}
+
+#define WMS_CACHE_MAGIC   MKTAG('W','M','S','C')
+#define WMS_CACHE_HDRSIZE 16
+#define WMS_CACHE_EXT     ".wms"
+
+/*
+ * Cache entries are stored as <cache_dir>/<md5 of url>.wms:
+ *   u32le magic, u32le size of the validators, s64le expiry (unix time),
+ *   validators (ETag and Last-Modified, NUL terminated), body
+ * Expired entries with validators are kept to be revalidated.
+ */
+
+typedef struct WMSCacheEntry {
+    uint8_t *map;
+    size_t map_size;
+    const uint8_t *body;
+    size_t body_size;
+    const char *etag, *last_modified;
+    int stale;                      ///< expired, must be revalidated before use
+} WMSCacheEntry;
+static char *cache_path(WMSContext *s, const char *url)
+{
+    uint8_t md5[16];
+    char hex[33];
+
+    av_md5_sum(md5, url, strlen(url));
+    for (int i = 0; i < 16; i++)
+        snprintf(hex + 2 * i, 3, "%02x", md5[i]);
+    return av_asprintf("%s/%s" WMS_CACHE_EXT, s->cache_dir, hex);
+}
+
+typedef struct WMSCacheFile {
+    char *path;
+    int64_t size;
+    time_t mtime;
+} WMSCacheFile;
+
+static int cmp_cache_file(const void *a, const void *b)
+{
+    const WMSCacheFile *fa = a, *fb = b;
+    return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+/**
+ * Compute the size of cache_dir and, if it exceeds cache_size, remove the
+ * oldest entries until it is back to 3/4 of it.
+ * Must be called with cache_lock held.
+ */
+static void disk_cache_trim(AVFilterContext *ctx)
+{
+#if HAVE_DIRENT_H
+    WMSContext *s = ctx->priv;
+    WMSCacheFile *files = NULL, *tmp;
+    int nb_files = 0, nb_alloc = 0;
+    int64_t total = 0;
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir = opendir(s->cache_dir);
+
+    if (!dir) {
+        av_log(ctx, AV_LOG_WARNING, "Cannot open cache directory '%s'\n", s->cache_dir);
+        return;
+    }
+    while ((entry = readdir(dir))) {
+        size_t len = strlen(entry->d_name);
+        char *path;
+        if (len <= strlen(WMS_CACHE_EXT) ||
+            strcmp(entry->d_name + len - strlen(WMS_CACHE_EXT), WMS_CACHE_EXT))
+            continue;
+        if (!(path = av_asprintf("%s/%s", s->cache_dir, entry->d_name)))
+            break;
+        if (stat(path, &st) < 0) {
+            av_free(path);
+            continue;
+        }
+        if (nb_files == nb_alloc) {
+            nb_alloc = FFMAX(16, 2 * nb_alloc);
+            if (!(tmp = av_realloc_array(files, nb_alloc, sizeof(*files)))) {
+                av_free(path);
+                break;
+            }
+            files = tmp;
+        }
+        files[nb_files++] = (WMSCacheFile){ path, st.st_size, st.st_mtime };
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    if (total > s->cache_size) {
+        qsort(files, nb_files, sizeof(*files), cmp_cache_file);
+        for (int i = 0; i < nb_files && total > s->cache_size / 4 * 3; i++) {
+            if (!remove(files[i].path))
+                total -= files[i].size;
+        }
+        av_log(ctx, AV_LOG_VERBOSE, "Trimmed cache directory to %"PRId64" bytes\n", total);
+    }
+    s->cache_bytes = total;
+
+    for (int i = 0; i < nb_files; i++)
+        av_free(files[i].path);
+    av_free(files);
+#endif
+}
+
+static av_cold int init_disk_cache(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    int ret;
+
+    if ((ret = ff_mutex_init(&s->cache_lock, NULL))) {
+        av_freep(&s->cache_dir);
+        return AVERROR(ret);
+    }
+#if !HAVE_DIRENT_H
+    av_log(ctx, AV_LOG_WARNING, "cache_size is not enforced on this platform\n");
+#endif
+    disk_cache_trim(ctx);
+    av_log(ctx, AV_LOG_DEBUG, "Using cache directory '%s' (%"PRId64" bytes)\n",
+           s->cache_dir, s->cache_bytes);
+    return 0;
+}
+
+/**
+ * Map the cache entry of url if it is present and either not expired or
+ * revalidatable. The entry must be released with disk_cache_release().
+ *
+ * @return 1 on hit, 0 on miss
+ */
+static int disk_cache_get(AVFilterContext *ctx, const char *url, WMSCacheEntry *e)
+{
+    WMSContext *s = ctx->priv;
+    char *path = cache_path(s, url);
+    int hit = 0;
+
+    memset(e, 0, sizeof(*e));
+    if (!path)
+        return 0;
+    // A miss is the common case, do not report it as an error
+    if (av_file_map(path, &e->map, &e->map_size, AV_LOG_DEBUG - AV_LOG_ERROR, ctx) >= 0) {
+        size_t vsize = e->map_size >= WMS_CACHE_HDRSIZE ? AV_RL32(e->map + 4) : 0;
+
+        if (e->map_size >= WMS_CACHE_HDRSIZE && AV_RL32(e->map) == WMS_CACHE_MAGIC &&
+            vsize <= e->map_size - WMS_CACHE_HDRSIZE) {
+            const char *v = (const char *)e->map + WMS_CACHE_HDRSIZE;
+            size_t len = av_strnlen(v, vsize);
+
+            e->etag = e->last_modified = "";
+            if (len + 1 < vsize && !v[vsize - 1]) {
+                e->etag          = v;
+                e->last_modified = v + len + 1;
+            }
+            e->body      = e->map + WMS_CACHE_HDRSIZE + vsize;
+            e->body_size = e->map_size - WMS_CACHE_HDRSIZE - vsize;
+            e->stale     = AV_RL64(e->map + 8) <= time(NULL);
+            hit = !e->stale || *e->etag || *e->last_modified;
+        }
+        if (!hit) {
+            av_file_unmap(e->map, e->map_size);
+            remove(path);
+        }
+    }
+    av_free(path);
+    return hit;
+}
+
+static void disk_cache_release(WMSCacheEntry *e)
+{
+    av_file_unmap(e->map, e->map_size);
+    memset(e, 0, sizeof(*e));
+}
+
+static void disk_cache_put(AVFilterContext *ctx, const char *url,
+                           const uint8_t *data, size_t size, int64_t ttl,
+                           const char *etag, const char *last_modified)
+{
+    WMSContext *s = ctx->priv;
+    uint8_t hdr[WMS_CACHE_HDRSIZE];
+    char *path = cache_path(s, url);
+    char *tmp_path = path ? av_asprintf("%s.%08x.tmp", path, av_get_random_seed()) : NULL;
+    FILE *f = tmp_path ? avpriv_fopen_utf8(tmp_path, "wb") : NULL;
+    size_t etag_size, lm_size, vsize;
+    int ok;
+
+    if (!f) {
+        av_log(ctx, AV_LOG_WARNING, "Cannot write to cache directory '%s'\n", s->cache_dir);
+        goto end;
+    }
+
+    etag          = etag          ? etag          : "";
+    last_modified = last_modified ? last_modified : "";
+    etag_size = strlen(etag) + 1;
+    lm_size   = strlen(last_modified) + 1;
+    vsize     = etag_size + lm_size > 2 ? etag_size + lm_size : 0;
+
+    AV_WL32(hdr,     WMS_CACHE_MAGIC);
+    AV_WL32(hdr + 4, vsize);
+    AV_WL64(hdr + 8, time(NULL) + ttl / AV_TIME_BASE);
+    ok = fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr) &&
+         (!vsize || (fwrite(etag, 1, etag_size, f) == etag_size &&
+                     fwrite(last_modified, 1, lm_size, f) == lm_size)) &&
+         fwrite(data, 1, size, f) == size;
+    ok &= !fclose(f);
+    // Write then rename so that readers never see a partial entry
+    if (!ok || rename(tmp_path, path)) {
+        av_log(ctx, AV_LOG_WARNING, "Failed to write cache entry '%s'\n", path);
+        remove(tmp_path);
+        goto end;
+    }
+
+    ff_mutex_lock(&s->cache_lock);
+    s->cache_bytes += sizeof(hdr) + vsize + size;
+    if (s->cache_bytes > s->cache_size)
+        disk_cache_trim(ctx);
+    ff_mutex_unlock(&s->cache_lock);
+end:
+    av_free(path);
+    av_free(tmp_path);
+}
+
+/*
+ * Parsed capabilities are cached along GetMap responses, as key=value lines.
+ * What is read from them depends on the requested layers and, for the WMTS
+ * resource URL template, on the format, which are part of the key.
+ */
+static char *caps_cache_key(WMSContext *s)
+{
+    return av_asprintf("GetCapabilities %s layers=%s format=%s",
+                       s->capabilities_url, s->layers, s->format);
+}
+
+/**
+ * Add a tile matrix stored as "res x0 y0 tile_w tile_h cols rows id"
+ */
+static int caps_cache_matrix(WMSContext *s, const char *val)
+{
+    WMSTileMatrix tm = { 0 }, *matrices;
+    int n = 0;
+
+    if (sscanf(val, "%lf %lf %lf %d %d %"SCNd64" %"SCNd64" %n", &tm.res, &tm.x0, &tm.y0,
+               &tm.tile_w, &tm.tile_h, &tm.cols, &tm.rows, &n) < 7 || !n)
+        return 0;
+    av_strlcpy(tm.id, val + n, sizeof(tm.id));
+    matrices = av_realloc_array(s->matrices, s->nb_matrices + 1, sizeof(*matrices));
+    if (!matrices)
+        return AVERROR(ENOMEM);
+    s->matrices = matrices;
+    s->matrices[s->nb_matrices++] = tm;
+    return 0;
+}
+
+/**
+ * Where to store the value of a cached dimension key, time or time_layers
+ * for instance, NULL if key is not one
+ */
+static char **caps_cache_dim(WMSContext *s, const char *key)
+{
+    for (int d = 0; d < WMS_DIM_NB; d++) {
+        const char *rest;
+        if (av_strstart(key, dim_names[d], &rest)) {
+            if (!*rest)
+                return &s->dim_values[d];
+            if (!strcmp(rest, "_layers"))
+                return &s->dim_layers[d];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Load cached capabilities, and their validators if they are stale
+ *
+ * @return 0 on miss, 1 on hit, 2 if the capabilities must be revalidated,
+ * or a negative error code
+ */
+static int caps_cache_get(AVFilterContext *ctx, WMSValidators *v)
+{
+    WMSContext *s = ctx->priv;
+    char *key = caps_cache_key(s), *str = NULL, *line, *saveptr = NULL;
+    WMSCacheEntry e;
+    int stale, ret = 0;
+
+    if (!key)
+        return AVERROR(ENOMEM);
+    if (!disk_cache_get(ctx, key, &e))
+        goto end;
+    str = av_strndup(e.body, e.body_size);
+    if ((stale = e.stale)) {
+        v->etag          = av_strdup(e.etag);
+        v->last_modified = av_strdup(e.last_modified);
+    }
+    disk_cache_release(&e);
+    if (!str || (stale && (!v->etag || !v->last_modified))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (line = av_strtok(str, "\n", &saveptr); line; line = av_strtok(NULL, "\n", &saveptr)) {
+        char *val = strchr(line, '='), **dst = NULL;
+
+        if (!val)
+            continue;
+        *val++ = 0;
+        if      (!strcmp(line, "version"))    dst = &s->version;
+        else if (!strcmp(line, "service"))    dst = &s->service;
+        else if (!strcmp(line, "url"))        dst = &s->url;
+        else if (!strcmp(line, "formats"))    dst = &s->formats;
+        else if (!strcmp(line, "max_width"))  s->caps_max_width  = strtol(val, NULL, 10);
+        else if (!strcmp(line, "max_height")) s->caps_max_height = strtol(val, NULL, 10);
+        else if (!strcmp(line, "layers"))     s->nb_layers_found = strtol(val, NULL, 10);
+        else if (!strcmp(line, "tile_style")) dst = &s->tile_style;
+        else if (!strcmp(line, "matrix_set")) dst = &s->tile_matrix_set;
+        else if (!strcmp(line, "matrix") && (ret = caps_cache_matrix(s, val)) < 0)
+            goto end;
+        else
+            dst = caps_cache_dim(s, line);
+        if (dst && !*dst && !(*dst = av_strdup(val))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+    ret = 0;
+    if (s->nb_matrices)
+        s->tile_service = WMS_TILES_WMTS;
+    if (s->version && s->service && s->url && s->formats &&
+        (!s->tile_service || (s->tile_style && s->tile_matrix_set)))
+        ret = stale ? 2 : 1;
+    else
+        av_log(ctx, AV_LOG_WARNING, "Ignoring invalid cached capabilities\n");
+end:
+    if (ret <= 0) {
+        caps_reset(s);
+        validators_free(v);
+    }
+    av_free(str);
+    av_free(key);
+    return ret;
+}
+
+static void caps_cache_put(AVFilterContext *ctx, const WMSValidators *v)
+{
+    WMSContext *s = ctx->priv;
+    char *key = caps_cache_key(s);
+    AVBPrint buf;
+
+    if (!key)
+        return;
+    av_bprint_init(&buf, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&buf, "version=%s\nservice=%s\nurl=%s\nformats=%s\n"
+               "max_width=%d\nmax_height=%d\nlayers=%d\n",
+               s->version, s->service, s->url, s->formats,
+               s->caps_max_width, s->caps_max_height, s->nb_layers_found);
+    for (int d = 0; d < WMS_DIM_NB; d++)
+        if (s->dim_values[d])
+            av_bprintf(&buf, "%s=%s\n%s_layers=%s\n", dim_names[d], s->dim_values[d],
+                       dim_names[d], s->dim_layers[d]);
+    if (s->tile_service == WMS_TILES_WMTS) {
+        av_bprintf(&buf, "tile_style=%s\nmatrix_set=%s\n", s->tile_style, s->tile_matrix_set);
+        for (int i = 0; i < s->nb_matrices; i++) {
+            const WMSTileMatrix *tm = &s->matrices[i];
+            av_bprintf(&buf, "matrix=%.17g %.17g %.17g %d %d %"PRId64" %"PRId64" %s\n",
+                       tm->res, tm->x0, tm->y0, tm->tile_w, tm->tile_h, tm->cols, tm->rows, tm->id);
+        }
+    }
+    if (av_bprint_is_complete(&buf))
+        disk_cache_put(ctx, key, buf.str, buf.len, s->caps_ttl, v->etag, v->last_modified);
+    av_bprint_finalize(&buf, NULL);
+    av_free(key);
+}
+
+static int parse_getcapabilities(AVFilterContext *ctx) {
+    WMSContext *s = ctx->priv;
+    WMSValidators v = { 0 };
+    int cache = s->cache_dir && s->caps_ttl;
+    int nb_layers = count_layers(s->layers);
+    int ret = 0;
+
+    if (cache && (ret = caps_cache_get(ctx, &v)) < 0)
+        return ret;
+    if (ret == 1) {
+        av_log(ctx, AV_LOG_DEBUG, "Using cached capabilities\n");
+    } else {
+        // Stale cached capabilities are kept if the service did not change
+        ret = read_xml(ctx, &v);
+        if (ret > 0)
+            av_log(ctx, AV_LOG_DEBUG, "Revalidated cached capabilities\n");
+        if (ret >= 0 && cache)
+            caps_cache_put(ctx, &v);
+        validators_free(&v);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (s->tile_service) {
+        av_log(ctx, AV_LOG_VERBOSE, "WMTS layer with %d levels of TileMatrixSet '%s'\n",
+               s->nb_matrices, s->tile_matrix_set);
+        return 0;
+    }
+
+    // Larger frames are split in several requests
+    if (!s->max_width)
+        s->max_width = s->caps_max_width;
+    if (!s->max_height)
+        s->max_height = s->caps_max_height;
+    if (!av_match_name(s->format, s->formats))
+        av_log(ctx, AV_LOG_WARNING, "Format %s is not advertised for GetMap\n", s->format);
+    if (s->nb_layers_found < nb_layers)
+        av_log(ctx, AV_LOG_WARNING, "Only %d of the %d requested layers are advertised\n",
+               s->nb_layers_found, nb_layers);
+    return 0;
+}
+
+// Bboxes closer than 1/WMS_BBOX_QUANT pixel share the same cache entry
+#define WMS_BBOX_QUANT 8
+
+/**
+ * Keys are unique over the instances sharing a cache: frames synthesized
+ * from keyframes only match frames synthesized likewise.
+ *
+ * @param fmt  GetMap URL format the frame is requested with
+ * @param dims query parameters of the dimensions of the frame
+ */
+static char *frame_cache_key(WMSContext *s, const char *fmt, const MapReadContext *map,
+                             const char *dims)
+{
+    double qx = fabs(map->x2 - map->x1) / (s->w * WMS_BBOX_QUANT);
+    double qy = fabs(map->y2 - map->y1) / (s->h * WMS_BBOX_QUANT);
+    const char *synth = s->keyframes > 1 || s->overfetch ? "~" : "";
+
+    if (!qx || !qy)
+        return av_asprintf("%s%s|%a,%a,%a,%a,%dx%d%s", synth, fmt,
+                           map->x1, map->y1, map->x2, map->y2, s->w, s->h, dims);
+    return av_asprintf("%s%s|%"PRId64",%"PRId64",%"PRId64",%"PRId64",%a,%a,%dx%d%s", synth, fmt,
+                       (int64_t)llrint(map->x1 / qx), (int64_t)llrint(map->y1 / qy),
+                       (int64_t)llrint(map->x2 / qx), (int64_t)llrint(map->y2 / qy),
+                       qx, qy, s->w, s->h, dims);
+}
+
+#if HAVE_MMAP
+/*
+ * Decoded tiles shared by the processes of a node, in a POSIX shared memory
+ * object or a memory-mapped file: a header, the fetch locks, then the slots
+ * holding a tile each. A tile may be stored in any of WMS_SHM_PROBES slots
+ * after the one its hash points to, the least recently used one is evicted.
+ *
+ * Nothing is ever locked to read or write a slot: a slot is claimed by
+ * making its sequence number odd with a CAS, and readers copy it out and
+ * check the sequence number did not change meanwhile. A process about to
+ * fetch a missing tile takes the fetch lock of its hash, the others wait
+ * for the tile rather than fetching it too.
+ */
+#define WMS_SHM_MAGIC    MKTAG('W','M','S','T')
+#define WMS_SHM_VERSION  1
+#define WMS_SHM_ALIGN    64
+#define WMS_SHM_PROBES   8
+#define WMS_SHM_LOCKS    4096
+#define WMS_SHM_POLL     2000   ///< interval tiles being fetched by another process are polled at, in us
+#define WMS_SHM_INIT     1000000 ///< time the creator of the cache has to initialize it, in us
+
+typedef struct WMSShmHeader {
+    atomic_uint magic;      ///< stored last by the process creating the cache
+    uint32_t version;
+    uint32_t nb_slots;
+    uint32_t slot_size;     ///< in bytes, its header included
+    uint32_t nb_locks;
+} WMSShmHeader;
+
+typedef struct WMSShmLock {
+    atomic_uint_least64_t key;  ///< tile being fetched, 0 if none
+    atomic_int_least64_t since; ///< time the fetch started, in us
+} WMSShmLock;
+
+typedef struct WMSShmSlot {
+    atomic_uint_least64_t seq;  ///< odd while the slot is written
+    atomic_uint_least64_t key;  ///< first half of the MD5 of the tile URL, 0 if empty
+    atomic_int_least64_t used;  ///< time of the last use, or of the claim while odd, in us
+    uint64_t key2;              ///< second half of the MD5
+    int64_t fetched;            ///< time the tile was fetched at, in us
+    int32_t width, height;      ///< RGBA pixels follow the header, without padding
+} WMSShmSlot;
+
+#define WMS_SHM_HDR_SIZE  FFALIGN(sizeof(WMSShmHeader), WMS_SHM_ALIGN)
+#define WMS_SHM_SLOT_HDR  FFALIGN(sizeof(WMSShmSlot), WMS_SHM_ALIGN)
+
+static WMSShmLock *shm_lock(const WMSContext *s, uint64_t key)
+{
+    WMSShmLock *locks = (WMSShmLock *)((uint8_t *)s->shm + WMS_SHM_HDR_SIZE);
+    return &locks[key % s->shm->nb_locks];
+}
+
+static WMSShmSlot *shm_slot(const WMSContext *s, uint64_t i)
+{
+    size_t locks_size = FFALIGN(s->shm->nb_locks * sizeof(WMSShmLock), WMS_SHM_ALIGN);
+    return (WMSShmSlot *)((uint8_t *)s->shm + WMS_SHM_HDR_SIZE + locks_size +
+                          (i % s->shm->nb_slots) * s->shm->slot_size);
+}
+
+/**
+ * A process which died while fetching a tile or writing a slot has not let
+ * go of it after that long, retries and their delays included
+ */
+static int64_t shm_stale_time(const WMSContext *s)
+{
+    return 2 * (s->timeout + 1000000) * (s->retries + 1);
+}
+
+static void shm_key(const char *url, uint64_t key[2])
+{
+    uint8_t md5[16];
+
+    av_md5_sum(md5, url, strlen(url));
+    key[0] = AV_RN64(md5) | 1;
+    key[1] = AV_RN64(md5 + 8);
+}
+
+/**
+ * Remove the shared tile cache, processes mapping it keep their mapping
+ */
+static void shm_remove(const WMSContext *s, const char *name)
+{
+#if HAVE_SHM_OPEN
+    if (s->shm_name) {
+        shm_unlink(name);
+        return;
+    }
+#endif
+    unlink(name);
+}
+
+/**
+ * Map the shared tile cache, creating it if it does not exist. It is never
+ * removed, as other processes may be using it or start to: it outlives the
+ * process and must be removed by the user.
+ */
+static av_cold int init_shm_cache(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    const char *name = s->shm_name ? s->shm_name : s->shm_file;
+    int tile_w = s->tile_service ? s->matrices[0].tile_w : s->tile_size;
+    int tile_h = s->tile_service ? s->matrices[0].tile_h : s->tile_size;
+    size_t slot_size = WMS_SHM_SLOT_HDR + FFALIGN((size_t)tile_w * tile_h * 4, WMS_SHM_ALIGN);
+    size_t locks_size = FFALIGN(WMS_SHM_LOCKS * sizeof(WMSShmLock), WMS_SHM_ALIGN);
+    int64_t size = s->shm_size, start = av_gettime_relative();
+    int fd, created = 1, ret = 0;
+    struct stat st;
+    void *map;
+
+    if (s->shm_name && s->shm_file) {
+        av_log(ctx, AV_LOG_ERROR, "shm_cache and shm_cache_file cannot be used together\n");
+        return AVERROR(EINVAL);
+    }
+    if (size < WMS_SHM_HDR_SIZE + locks_size + WMS_SHM_PROBES * slot_size ||
+        (size - WMS_SHM_HDR_SIZE - locks_size) / slot_size > UINT32_MAX) {
+        av_log(ctx, AV_LOG_ERROR, "shm_cache_size does not fit between %d and 2^32 tiles\n",
+               WMS_SHM_PROBES);
+        return AVERROR(EINVAL);
+    }
+
+    if (s->shm_name) {
+#if HAVE_SHM_OPEN
+        if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0 && errno == EEXIST) {
+            fd = shm_open(name, O_RDWR, 0);
+            created = 0;
+        }
+#else
+        av_log(ctx, AV_LOG_ERROR, "POSIX shared memory is not supported on this platform, "
+               "use shm_cache_file\n");
+        return AVERROR(ENOSYS);
+#endif
+    } else if ((fd = avpriv_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0 && errno == EEXIST) {
+        fd = avpriv_open(name, O_RDWR);
+        created = 0;
+    }
+    if (fd < 0) {
+        ret = AVERROR(errno);
+        av_log(ctx, AV_LOG_ERROR, "Could not open shared tile cache '%s': %s\n",
+               name, av_err2str(ret));
+        return ret;
+    }
+
+    if (created) {
+        if (ftruncate(fd, size) < 0) {
+            ret = AVERROR(errno);
+            goto fail;
+        }
+    } else {
+        // The creator may not have sized it yet
+        while (!(ret = fstat(fd, &st)) && !st.st_size &&
+               av_gettime_relative() - start < WMS_SHM_INIT)
+            av_usleep(WMS_SHM_POLL);
+        if (ret < 0 || st.st_size < WMS_SHM_HDR_SIZE) {
+            ret = ret < 0 ? AVERROR(errno) : AVERROR_INVALIDDATA;
+            if (ret == AVERROR_INVALIDDATA && !st.st_size)
+                av_log(ctx, AV_LOG_ERROR, "Shared tile cache '%s' is empty, remove it if its creator died\n", name);
+            goto fail;
+        }
+        size = st.st_size;
+    }
+    if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    close(fd);
+    s->shm          = map;
+    s->shm_map_size = size;
+
+    // The file is zeroed, which makes all the slots and locks free
+    if (created) {
+        s->shm->version   = WMS_SHM_VERSION;
+        s->shm->nb_locks  = WMS_SHM_LOCKS;
+        s->shm->slot_size = slot_size;
+        s->shm->nb_slots  = (size - WMS_SHM_HDR_SIZE - locks_size) / slot_size;
+        atomic_store_explicit(&s->shm->magic, WMS_SHM_MAGIC, memory_order_release);
+    } else {
+        while (atomic_load_explicit(&s->shm->magic, memory_order_acquire) != WMS_SHM_MAGIC) {
+            if (av_gettime_relative() - start > WMS_SHM_INIT) {
+                av_log(ctx, AV_LOG_ERROR, "Shared tile cache '%s' is not initialized, remove it if its creator died\n", name);
+                return AVERROR_INVALIDDATA;
+            }
+            av_usleep(WMS_SHM_POLL);
+        }
+        if (s->shm->version != WMS_SHM_VERSION || !s->shm->nb_locks ||
+            s->shm->nb_slots < WMS_SHM_PROBES ||
+            WMS_SHM_HDR_SIZE + FFALIGN(s->shm->nb_locks * sizeof(WMSShmLock), WMS_SHM_ALIGN) +
+            (uint64_t)s->shm->nb_slots * s->shm->slot_size > size) {
+            av_log(ctx, AV_LOG_ERROR, "Shared tile cache '%s' is invalid, remove it\n", name);
+            return AVERROR_INVALIDDATA;
+        }
+        if (s->shm->slot_size < slot_size) {
+            av_log(ctx, AV_LOG_ERROR, "Shared tile cache '%s' holds tiles of %u bytes, %"SIZE_SPECIFIER" needed\n",
+                   name, s->shm->slot_size - (unsigned)WMS_SHM_SLOT_HDR, slot_size - WMS_SHM_SLOT_HDR);
+            return AVERROR(EINVAL);
+        }
+    }
+    av_log(ctx, AV_LOG_VERBOSE, "%s shared tile cache '%s' of %u tiles\n",
+           created ? "Created" : "Using", name, s->shm->nb_slots);
+    return 0;
+fail:
+    av_log(ctx, AV_LOG_ERROR, "Could not map shared tile cache '%s': %s\n", name, av_err2str(ret));
+    close(fd);
+    // Do not leave behind an empty cache the next processes would fail to use
+    if (created)
+        shm_remove(s, name);
+    return ret;
+}
+
+/**
+ * Copy the tile of key out of the cache
+ *
+ * @return 1 on hit, 0 on miss, or a negative error code
+ */
+static int shm_cache_lookup(WMSContext *s, const uint64_t key[2], AVFrame **out, int w, int h)
+{
+    AVFrame *frame = NULL;
+    int ret;
+
+    for (int i = 0; i < WMS_SHM_PROBES; i++) {
+        WMSShmSlot *slot = shm_slot(s, key[0] + i);
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if ((seq & 1) || atomic_load_explicit(&slot->key, memory_order_relaxed) != key[0] ||
+            slot->key2 != key[1] || slot->width != w || slot->height != h ||
+            av_gettime() - slot->fetched > s->cache_ttl)
+            continue;
+        if (!frame) {
+            if (!(frame = av_frame_alloc()))
+                return AVERROR(ENOMEM);
+            frame->width  = w;
+            frame->height = h;
+            frame->format = AV_PIX_FMT_RGBA;
+            if ((ret = av_frame_get_buffer(frame, 0)) < 0) {
+                av_frame_free(&frame);
+                return ret;
+            }
+        }
+        av_image_copy_plane(frame->data[0], frame->linesize[0],
+                            (const uint8_t *)slot + WMS_SHM_SLOT_HDR, 4 * w, 4 * w, h);
+        // The copy is only good if no writer claimed the slot meanwhile
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+            continue;
+        atomic_store_explicit(&slot->used, av_gettime(), memory_order_relaxed);
+        *out = frame;
+        return 1;
+    }
+    av_frame_free(&frame);
+    return 0;
+}
+
+/**
+ * Get the tile of key from the cache, waiting for it if another process is
+ * fetching it. On a miss, the fetch lock of the tile may be returned in
+ * lock, which must then be released with shm_cache_unlock() once the tile
+ * is fetched and stored.
+ *
+ * @return 1 on hit, 0 on miss, or a negative error code
+ */
+static int shm_cache_get(AVFilterContext *ctx, const uint64_t key[2], AVFrame **out,
+                         int w, int h, WMSShmLock **lock)
+{
+    WMSContext *s = ctx->priv;
+    WMSShmLock *l = shm_lock(s, key[0]);
+    int64_t stale = shm_stale_time(s), start = av_gettime();
+    int ret;
+
+    *lock = NULL;
+    while (!(ret = shm_cache_lookup(s, key, out, w, h))) {
+        uint64_t cur = atomic_load(&l->key);
+        int64_t now = av_gettime();
+
+        if (cur && now - atomic_load(&l->since) > stale) {
+            av_log(ctx, AV_LOG_WARNING, "Taking over a tile fetch of another process\n");
+        } else if (cur == key[0] && now - start < stale) {
+            av_usleep(WMS_SHM_POLL);
+            continue;
+        } else if (cur) {
+            // Another tile has the same lock, fetch without it
+            return 0;
+        }
+        if (atomic_compare_exchange_strong(&l->key, &cur, key[0])) {
+            atomic_store(&l->since, now);
+            *lock = l;
+            // The tile may have been stored between the lookup and the lock
+            if ((ret = shm_cache_lookup(s, key, out, w, h)))
+                break;
+            return 0;
+        }
+    }
+    if (*lock) {
+        uint64_t cur = key[0];
+        atomic_compare_exchange_strong(&(*lock)->key, &cur, 0);
+        *lock = NULL;
+    }
+    return ret;
+}
+
+static void shm_cache_unlock(WMSShmLock *lock, const uint64_t key[2])
+{
+    uint64_t cur = key[0];
+
+    // Unless another process took it over meanwhile
+    if (lock)
+        atomic_compare_exchange_strong(&lock->key, &cur, 0);
+}
+
+static void shm_cache_put(WMSContext *s, const uint64_t key[2], const AVFrame *frame)
+{
+    int64_t now = av_gettime(), stale = shm_stale_time(s);
+
+    if ((size_t)frame->width * frame->height * 4 > s->shm->slot_size - WMS_SHM_SLOT_HDR)
+        return;
+    for (int attempt = 0; attempt < WMS_SHM_PROBES; attempt++) {
+        WMSShmSlot *victim = NULL;
+        uint64_t victim_seq = 0, claim;
+        int64_t victim_rank = INT64_MAX;
+
+        for (int i = 0; i < WMS_SHM_PROBES; i++) {
+            WMSShmSlot *slot = shm_slot(s, key[0] + i);
+            uint64_t seq = atomic_load(&slot->seq), k = atomic_load(&slot->key);
+            int64_t used = atomic_load(&slot->used), rank;
+
+            if (!(seq & 1) && k == key[0] && slot->key2 == key[1] &&
+                slot->width == frame->width && slot->height == frame->height &&
+                now - slot->fetched <= s->cache_ttl)
+                return;
+            if ((seq & 1) && now - used <= stale)
+                continue;
+            // Empty slots first, then the least recently used ones, then the
+            // ones a dead process left claimed
+            rank = (seq & 1) ? INT64_MAX - 1 : k ? used : INT64_MIN;
+            if (rank < victim_rank) {
+                victim      = slot;
+                victim_seq  = seq;
+                victim_rank = rank;
+            }
+        }
+        if (!victim)
+            return;
+        claim = victim_seq + (victim_seq & 1 ? 2 : 1);
+        if (!atomic_compare_exchange_strong(&victim->seq, &victim_seq, claim))
+            continue;
+
+        atomic_store_explicit(&victim->used, now, memory_order_relaxed);
+        atomic_store_explicit(&victim->key, key[0], memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        victim->key2    = key[1];
+        victim->fetched = now;
+        victim->width   = frame->width;
+        victim->height  = frame->height;
+        av_image_copy_plane((uint8_t *)victim + WMS_SHM_SLOT_HDR, 4 * frame->width,
+                            frame->data[0], frame->linesize[0], 4 * frame->width, frame->height);
+        atomic_store_explicit(&victim->seq, claim + 1, memory_order_release);
+        return;
+    }
+}
+#endif
+
+/**
+ * Keyframe of a group being fetched, a frame only needs the one of its
+ * group, which is fetched by the first frame needing it. With overfetch,
+ * a group is the run of frames cropped from the same image.
+ */
+typedef struct WMSKeyframe {
+    int64_t group;          ///< -1 if the entry is free
+    AVFrame *frame;
+    int loading;
+    int pending;            ///< frames of the group not done yet
+    int complete;           ///< whether all the frames of the group are scheduled
+} WMSKeyframe;
+
+static av_cold int init_keyframes(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    int ret;
+
+    // The groups of the frames scheduled, plus the one of the frames done
+    // but not complete yet. Overfetched groups may be one frame long.
+    s->nb_keys  = (s->overfetch ? s->prefetch : s->prefetch / s->keyframes) + 2;
+    s->key_maps = av_calloc(s->keyframes, sizeof(*s->key_maps));
+    s->keys     = av_calloc(s->nb_keys, sizeof(*s->keys));
+    if (!s->key_maps || !s->keys) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if ((ret = ff_mutex_init(&s->key_lock, NULL))) {
+        ret = AVERROR(ret);
+        goto fail;
+    }
+    if ((ret = ff_cond_init(&s->key_cond, NULL))) {
+        ff_mutex_destroy(&s->key_lock);
+        ret = AVERROR(ret);
+        goto fail;
+    }
+    s->key_group = s->open_group = -1;
+    for (int i = 0; i < s->nb_keys; i++)
+        s->keys[i].group = -1;
+    return 0;
+fail:
+    av_freep(&s->key_maps);
+    av_freep(&s->keys);
+    s->keyframes = 0;
+    s->overfetch = 0;
+    return ret;
+}
+
+static av_cold int init(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    int ret;
+
+    if ((ret = init_expressions(ctx)) < 0)
+        return ret;
+    if (s->cache_dir && (ret = init_disk_cache(ctx)) < 0)
+        return ret;
+    if (s->request_rate && (ret = init_rate_limit(ctx)) < 0)
+        return ret;
+    if (s->tile_size && s->tile_size < 16) {
+        av_log(ctx, AV_LOG_ERROR, "tile_size must be at least 16\n");
+        return AVERROR(EINVAL);
+    }
+    if (!s->end_pts)
+        s->end_pts = INFINITY;
+
+    // Output what JPEG decodes to, so that it can go untouched to an encoder
+    if (!av_strcasecmp(s->format, "image/jpeg") || !av_strcasecmp(s->format, "image/jpg"))
+        s->pix_fmt = AV_PIX_FMT_YUV420P;
+    else
+        s->pix_fmt = AV_PIX_FMT_RGBA;
+
+    if((ret = init_format_force(ctx)) < 0)
+        return ret;
+    if(ret == 0) {
+        av_log(ctx, AV_LOG_DEBUG, "Forcing url format: %s\n", s->fmt_url);
+    } else {
+        if ((ret=parse_getcapabilities(ctx))<0)
+            return ret;
+        if (s->tile_service) {
+            if ((ret = init_wmts(ctx)) < 0)
+                return ret;
+        } else {
+            if((ret = init_version(ctx)) < 0)
+                return ret;
+            if((ret = init_format(ctx)) < 0)
+                return ret;
+        }
+        av_log(ctx, AV_LOG_DEBUG, "Successfully initialized WMS Context from GetCapabilities\n");
+    }
+    // Tile services always output tiles
+    if (s->tile_service)
+        s->tile_size = s->matrices[0].tile_w;
+
+    // Tiles are only worth it if they are kept: by default keep twice the
+    // tiles covering a frame, grown by fetch_mosaic() to the tiles needed
+    if (s->tile_size && !s->frame_cache_size) {
+        s->frame_cache_size = 2LL * (s->w / s->tile_size + 2) * (s->h / s->tile_size + 2) *
+                              s->tile_size * s->tile_size * 4;
+        s->frame_cache_auto = 1;
+    }
+    if ((ret = ff_wms_fetch_open(&s->fetch_svc, s->shared, s->frame_cache_size)) < 0)
+        return ret;
+    if (s->shared)
+        av_log(ctx, AV_LOG_VERBOSE, "Sharing fetches with %d other instance(s)\n", ret - 1);
+    if (s->frame_cache_size)
+        s->frame_cache = ff_wms_fetch_cache(s->fetch_svc);
+    if (s->shm_name || s->shm_file) {
+#if HAVE_MMAP
+        if (!s->tile_size)
+            av_log(ctx, AV_LOG_WARNING, "The shared tile cache needs tile_size or a tile service, ignoring it\n");
+        else if ((ret = init_shm_cache(ctx)) < 0)
+            return ret;
+#else
+        av_log(ctx, AV_LOG_ERROR, "Shared tile caches are not supported on this platform\n");
+        return AVERROR(ENOSYS);
+#endif
+    }
+    if (s->keyframes > 1 && s->tile_size) {
+        av_log(ctx, AV_LOG_ERROR, "keyframes and tile_size cannot be used together\n");
+        return AVERROR(EINVAL);
+    }
+    if (s->overfetch && (s->keyframes > 1 || s->tile_size)) {
+        av_log(ctx, AV_LOG_ERROR, "overfetch cannot be used with keyframes or tile_size\n");
+        return AVERROR(EINVAL);
+    }
+    if (s->nb_split_layers && (s->keyframes > 1 || s->overfetch || s->tile_size)) {
+        av_log(ctx, AV_LOG_ERROR, "split_layers cannot be used with keyframes, overfetch or tile_size\n");
+        return AVERROR(EINVAL);
+    }
+    if (s->split_layers && !s->nb_split_layers)
+        av_log(ctx, AV_LOG_WARNING, "split_layers needs several layers of a WMS, ignoring it\n");
+    if ((ret = init_dimensions(ctx)) < 0)
+        return ret;
+    if (s->nb_dims && (s->keyframes > 1 || s->overfetch || s->tile_size)) {
+        av_log(ctx, AV_LOG_ERROR, "time and elevation cannot be used with keyframes, overfetch or tile_size\n");
+        return AVERROR(EINVAL);
+    }
+    // When some layers vary, keep the others rather than composites
+    s->cache_layers = s->nb_split_layers && (s->nb_dynamic_layers || s->nb_dims);
+    if ((s->keyframes > 1 || s->overfetch) && (ret = init_keyframes(ctx)) < 0)
+        return ret;
+    return 0;
+}
+
+static av_cold void uninit(AVFilterContext *ctx){
+    WMSContext *s = ctx->priv;
+
+    // Do not wait for stalled requests
+    if (s->fetch_svc)
+        ff_wms_fetch_stop(s->fetch_svc);
+
+    if (s->workers) {
+        ff_mutex_lock(&s->lock);
+        s->exiting = 1;
+        ff_cond_broadcast(&s->cond);
+        ff_mutex_unlock(&s->lock);
+        for (int i = 0; i < s->nb_workers; i++)
+            pthread_join(s->workers[i], NULL);
+        av_freep(&s->workers);
+        while (s->jobs) {
+            WMSJob *job = s->jobs;
+            s->jobs = job->next;
+            av_free(job);
+        }
+        ff_cond_destroy(&s->cond);
+        ff_mutex_destroy(&s->lock);
+    }
+    for (int i = 0; i < s->nb_slots; i++) {
+        av_frame_free(&s->slots[i].frame);
+        av_freep(&s->slots[i].url);
+    }
+    av_freep(&s->slots);
+    av_freep(&s->maps);
+    for (int i = 0; i < FF_ARRAY_ELEMS(s->exprs); i++)
+        av_expr_free(s->exprs[i]);
+
+#if HAVE_MMAP
+    if (s->shm)
+        munmap(s->shm, s->shm_map_size);
+#endif
+    ff_wms_fetch_close(&s->fetch_svc, s->max_conns, s->frame_cache_size);
+    s->frame_cache = NULL;
+    if (s->max_conns) {
+        ff_mutex_destroy(&s->conc_lock);
+        ff_cond_destroy(&s->conc_cond);
+    }
+    if (s->decoders) {
+        for (int i = 0; i < s->nb_decoders; i++)
+            avcodec_free_context(&s->decoders[i]);
+        av_freep(&s->decoders);
+        ff_mutex_destroy(&s->dec_lock);
+    }
+    if (s->cache_dir)
+        ff_mutex_destroy(&s->cache_lock);
+    if (s->request_rate)
+        ff_mutex_destroy(&s->rate_lock);
+    if (s->keys) {
+        for (int i = 0; i < s->nb_keys; i++)
+            av_frame_free(&s->keys[i].frame);
+        av_freep(&s->keys);
+        av_freep(&s->key_maps);
+        ff_mutex_destroy(&s->key_lock);
+        ff_cond_destroy(&s->key_cond);
+    }
+
+    stats_log(ctx, AV_LOG_VERBOSE);
+    if (s->stats_file)
+        stats_write(ctx);
+
+    av_freep(&s->url);
+    av_freep(&s->service);
+    av_freep(&s->version);
+    av_freep(&s->formats);
+    av_freep(&s->matrices);
+    av_freep(&s->tile_style);
+    av_freep(&s->tile_matrix_set);
+    for (int i = 0; i < s->nb_split_layers; i++)
+        av_freep(&s->layer_fmts[i]);
+    av_freep(&s->layer_fmts);
+    av_freep(&s->layer_dynamic);
+    av_freep(&s->layer_dims);
+    for (int d = 0; d < WMS_DIM_NB; d++) {
+        av_expr_free(s->dim_exprs[d]);
+        av_freep(&s->dim_ranges[d]);
+        av_freep(&s->dim_values[d]);
+        av_freep(&s->dim_layers[d]);
+    }
+    av_freep(&s->last_url);
+    av_frame_free(&s->last_frame);
+	av_free(s->fmt_url);
+    av_log(ctx, AV_LOG_DEBUG, "Successfully uninitialized WMS Context\n");
+}
+
+static av_cold int init_conn_pool(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    // One connection per request that can be in flight
+    int max_conns = s->nb_workers + 1;
+    int ret;
+
+    if (!s->max_concurrency || s->max_concurrency > max_conns)
+        s->max_concurrency = max_conns;
+    s->min_concurrency = FFMIN(s->min_concurrency, s->max_concurrency);
+    s->conc_limit = s->min_concurrency;
+
+    if ((ret = ff_mutex_init(&s->conc_lock, NULL)))
+        return AVERROR(ret);
+    if ((ret = ff_cond_init(&s->conc_cond, NULL))) {
+        ff_mutex_destroy(&s->conc_lock);
+        return AVERROR(ret);
+    }
+    ff_wms_fetch_add_conns(s->fetch_svc, max_conns);
+    s->max_conns = max_conns;
+    return 0;
+}
+
+/*
+ * The number of requests in flight is adapted AIMD style, like a TCP
+ * congestion window: it grows by one per response in slow start, then by
+ * one per round of responses, and is halved when the server shows signs of
+ * overload, at most once per round trip.
+ */
+#define WMS_LATENCY_FACTOR 2 ///< latency over the lowest one seen that means queuing
+
+/**
+ * Wait until one more request may be sent
+ */
+static void conc_acquire(WMSContext *s)
+{
+    ff_mutex_lock(&s->conc_lock);
+    while (s->conc_inflight >= (int)s->conc_limit)
+        ff_cond_wait(&s->conc_cond, &s->conc_lock);
+    s->conc_inflight++;
+    ff_mutex_unlock(&s->conc_lock);
+}
+
+/**
+ * @param http_code HTTP status of the response, 0 if there was none
+ */
+static int is_overload(int err, int http_code)
+{
+    // 429 Too Many Requests, 503 Service Unavailable and a server failing to
+    // answer in time
+    return http_code == 429 || http_code == 503 || err == AVERROR(ETIMEDOUT);
+}
+
+static void conc_release(AVFilterContext *ctx, int64_t start, int err, int http_code)
+{
+    WMSContext *s = ctx->priv;
+    int64_t now = av_gettime_relative(), latency = now - start;
+    double limit;
+    int overload = is_overload(err, http_code);
+
+    ff_mutex_lock(&s->conc_lock);
+    limit = s->conc_limit;
+    s->conc_inflight--;
+    if (err >= 0) {
+        s->min_latency = s->min_latency ? FFMIN(s->min_latency, latency) : latency;
+        s->avg_latency = s->avg_latency ? (7 * s->avg_latency + latency) / 8 : latency;
+        overload = s->avg_latency > WMS_LATENCY_FACTOR * s->min_latency &&
+                   s->conc_limit > s->min_concurrency;
+    }
+    if (overload) {
+        if (now - s->last_decrease > s->avg_latency) {
+            s->conc_limit = FFMAX(s->conc_limit / 2, s->min_concurrency);
+            s->conc_congested = 1;
+            s->last_decrease  = now;
+        }
+    } else if (err >= 0) {
+        s->conc_limit += s->conc_congested ? 1 / s->conc_limit : 1;
+        s->conc_limit  = FFMIN(s->conc_limit, s->max_concurrency);
+    }
+    if ((int)limit != (int)s->conc_limit)
+        av_log(ctx, AV_LOG_DEBUG, "%d requests in flight at most\n", (int)s->conc_limit);
+    ff_cond_broadcast(&s->conc_cond);
+    ff_mutex_unlock(&s->conc_lock);
+}
+
+/**
+ * Download url into body, over an idle keep-alive connection if there is
+ * one, else over a new one which is kept for the next requests.
+ *
+ * @param http_code set to the HTTP status of the response on failure, 0 if
+ *                  there was none
+ */
+static int http_get_once(AVFilterContext *ctx, const char *url, AVBPrint *body,
+                         const WMSCacheEntry *cached, WMSValidators *v, WMSFrameStats *st,
+                         int *http_code)
+{
+    WMSContext *s = ctx->priv;
+    AVIOContext *pb = ff_wms_conn_acquire(s->fetch_svc, url);
+    AVDictionary *opts = NULL;
+    int64_t start = av_gettime_relative(), headers;
+    int ret;
+
+    if (pb) {
+        set_validators(&opts, cached ? cached->etag : NULL, cached ? cached->last_modified : NULL);
+        ret = avpriv_http_do_new_request(pb, url, &opts);
+        av_dict_free(&opts);
+        // The server answered, sending the request again is up to the caller
+        if (ret < 0 && (*http_code = get_http_code(pb))) {
+            av_log(ctx, AV_LOG_WARNING, "Failed to open '%s': %s\n", url, av_err2str(ret));
+            avio_closep(&pb);
+            return ret;
+        }
+        if (ret < 0) {
+            if (ret != AVERROR_EOF)
+                av_log(ctx, AV_LOG_DEBUG, "Could not reuse connection: %s\n", av_err2str(ret));
+            avio_closep(&pb);
+        }
+    }
+    if (!pb) {
+        const char *caps_proto = avio_find_protocol_name(s->capabilities_url);
+
+        set_validators(&opts, cached ? cached->etag : NULL, cached ? cached->last_modified : NULL);
+        av_dict_set(&opts, "multiple_requests", "1", 0);
+        // Passed down to the socket, so that a stalled server is given up on
+        if (s->timeout)
+            av_dict_set_int(&opts, "timeout", s->timeout, 0);
+        // Unless the user gave it, the URL comes from a capabilities
+        // document, which must not make us read local files if remote
+        if (s->capabilities_url[0] != '%' && (!caps_proto || strcmp(caps_proto, "file")))
+            av_dict_set(&opts, "protocol_whitelist", "http,https,tcp,tls", 0);
+        ret = avpriv_http_open(&pb, url, ff_wms_fetch_interrupt_cb(s->fetch_svc),
+                               &opts, http_code);
+        av_dict_free(&opts);
+        st->new_conns++;
+        if (ret < 0) {
+            av_log(ctx, AV_LOG_WARNING, "Failed to open '%s': %s\n", url, av_err2str(ret));
+            return ret;
+        }
+        *http_code = 0;
+    }
+    headers = av_gettime_relative();
+    st->time[WMS_STAT_TTFB] += headers - start;
+
+    get_validators(pb, v);
+    if (cached && not_modified(pb)) {
+        ff_wms_conn_release(s->fetch_svc, url, pb);
+        return 1;
+    }
+    ret = avio_read_to_bprint(pb, body, INT_MAX);
+    st->time[WMS_STAT_TRANSFER] += av_gettime_relative() - headers;
+    st->bytes += body->len;
+    if (ret >= 0 && !av_bprint_is_complete(body))
+        ret = AVERROR(ENOMEM);
+    if (ret < 0) {
+        av_log(ctx, AV_LOG_WARNING, "Failed to read '%s': %s\n", url, av_err2str(ret));
+        avio_closep(&pb);
+        return ret;
+    }
+    ff_wms_conn_release(s->fetch_svc, url, pb);
+    return 0;
+}
+
+#define WMS_RETRY_DELAY     250000
+#define WMS_RETRY_DELAY_MAX 4000000
+
+/**
+ * Whether a failed request may succeed if sent again: when the connection
+ * failed, or the server timed out, was overloaded or failed itself.
+ *
+ * @param http_code HTTP status of the response, 0 if there was none
+ */
+static int is_retryable(int err, int http_code)
+{
+    if (http_code)
+        return http_code == 408 || http_code == 429 || http_code >= 500;
+    return err == AVERROR(ETIMEDOUT)    || err == AVERROR(ECONNRESET) ||
+           err == AVERROR(ECONNREFUSED) || err == AVERROR(EPIPE)      ||
+           err == AVERROR(EIO)          || err == AVERROR_EOF;
+}
+
+/**
+ * GET url into body, conditionally if a cache entry to revalidate is given.
+ * The validators of the response are returned in v. Failed requests are
+ * retried with an exponential backoff. What the requests took is added to
+ * st.
+ *
+ * @return 1 if cached is still valid, else 0 or a negative error code
+ */
+static int http_get(AVFilterContext *ctx, const char *url, AVBPrint *body,
+                    const WMSCacheEntry *cached, WMSValidators *v, WMSFrameStats *st)
+{
+    WMSContext *s = ctx->priv;
+
+    for (int attempt = 0;; attempt++) {
+        int64_t delay = FFMIN((int64_t)WMS_RETRY_DELAY << FFMIN(attempt, 16), WMS_RETRY_DELAY_MAX);
+        int64_t start, wait;
+        WMSHost *host;
+        int ret, http_code = 0;
+
+        st->time[WMS_STAT_THROTTLE] += rate_wait(s);
+        wait  = av_gettime_relative();
+        conc_acquire(s);
+        // The wait for the other instances is not server latency
+        host  = ff_wms_host_acquire(s->fetch_svc, url, s->shared ? s->host_concurrency : 0);
+        start = av_gettime_relative();
+        st->time[WMS_STAT_CONC] += start - wait;
+        st->requests++;
+        ret   = http_get_once(ctx, url, body, cached, v, st, &http_code);
+
+        conc_release(ctx, start, ret, http_code);
+        ff_wms_host_release(s->fetch_svc, host);
+        if (ret >= 0)
+            return ret;
+        if (attempt >= s->retries || !is_retryable(ret, http_code)) {
+            av_log(ctx, AV_LOG_ERROR, "Failed to get '%s' after %d attempt(s): %s\n",
+                   url, attempt + 1, av_err2str(ret));
+            return ret;
+        }
+        av_log(ctx, AV_LOG_VERBOSE, "Retrying in %"PRId64" ms\n", delay / 1000);
+        av_bprint_clear(body);
+        av_usleep(delay);
+    }
+}
+
+/**
+ * Guess the codec of an image from its first bytes
+ */
+static enum AVCodecID probe_codec(const uint8_t *data, int size)
+{
+    if (size >= 8 && !memcmp(data, "\x89PNG\r\n\x1a\n", 8))
+        return AV_CODEC_ID_PNG;
+    if (size >= 3 && !memcmp(data, "\xff\xd8\xff", 3))
+        return AV_CODEC_ID_MJPEG;
+    if (size >= 6 && (!memcmp(data, "GIF87a", 6) || !memcmp(data, "GIF89a", 6)))
+        return AV_CODEC_ID_GIF;
+    if (size >= 4 && (!memcmp(data, "II*\0", 4) || !memcmp(data, "MM\0*", 4)))
+        return AV_CODEC_ID_TIFF;
+    if (size >= 12 && !memcmp(data, "RIFF", 4) && !memcmp(data + 8, "WEBP", 4))
+        return AV_CODEC_ID_WEBP;
+    return AV_CODEC_ID_NONE;
+}
+
+static av_cold int init_decoder_pool(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    int ret;
+
+    s->max_decoders = s->nb_workers + 1;
+    s->decoders = av_calloc(s->max_decoders, sizeof(*s->decoders));
+    if (!s->decoders)
+        return AVERROR(ENOMEM);
+    if ((ret = ff_mutex_init(&s->dec_lock, NULL))) {
+        av_freep(&s->decoders);
+        return AVERROR(ret);
+    }
+    return 0;
+}
+
+/**
+ * Get an opened decoder for codec_id, reusing an idle one if possible
+ */
+static int decoder_acquire(AVFilterContext *ctx, AVCodecContext **dec, enum AVCodecID codec_id)
+{
+    WMSContext *s = ctx->priv;
+    AVDictionary *opt = NULL;
+    const AVCodec *codec;
+    int ret;
+
+    *dec = NULL;
+    ff_mutex_lock(&s->dec_lock);
+    for (int i = 0; i < s->nb_decoders; i++) {
+        if (s->decoders[i]->codec_id == codec_id) {
+            *dec = s->decoders[i];
+            s->decoders[i] = s->decoders[--s->nb_decoders];
+            break;
+        }
+    }
+    ff_mutex_unlock(&s->dec_lock);
+    if (*dec)
+        return 0;
+
+    if (!(codec = avcodec_find_decoder(codec_id))) {
+        av_log(ctx, AV_LOG_ERROR, "Failed to find codec\n");
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+    if (!(*dec = avcodec_alloc_context3(codec)))
+        return AVERROR(ENOMEM);
+    av_dict_set(&opt, "thread_type", "slice", 0);
+    ret = avcodec_open2(*dec, codec, &opt);
+    av_dict_free(&opt);
+    if (ret < 0) {
+        av_log(ctx, AV_LOG_ERROR, "Failed to open codec\n");
+        avcodec_free_context(dec);
+        return ret;
+    }
+    av_log(ctx, AV_LOG_DEBUG, "Opened a new %s decoder\n", codec->name);
+    return 0;
+}
+
+static void decoder_release(WMSContext *s, AVCodecContext *dec)
+{
+    // Images are independent, do not let a decoder carry state over
+    avcodec_flush_buffers(dec);
+    ff_mutex_lock(&s->dec_lock);
+    if (s->nb_decoders < s->max_decoders) {
+        s->decoders[s->nb_decoders++] = dec;
+        dec = NULL;
+    }
+    ff_mutex_unlock(&s->dec_lock);
+    avcodec_free_context(&dec);
+}
+
+/**
+ * Decode the image of an in-memory body into dst, which gets the
+ * decoder's own refcounted buffers.
+ *
+ * The body is fed as a single packet to an already opened decoder, there
+ * is no demuxing nor probing besides a look at the first bytes.
+ *
+ * @param buf buffer holding data followed by AV_INPUT_BUFFER_PADDING_SIZE
+ *            zeroed bytes, or NULL to let the decoder copy data
+ */
+static int decode_image(AVFrame *dst, AVFilterContext *ctx, const uint8_t *data, int size,
+                        AVBufferRef *buf)
+{
+    WMSContext *s = ctx->priv;
+    enum AVCodecID codec_id = probe_codec(data, size);
+    AVCodecContext *dec;
+    AVPacket *pkt;
+    int ret;
+
+    if (codec_id == AV_CODEC_ID_NONE) {
+        av_log(ctx, AV_LOG_ERROR, "Response is not an image: %.*s\n", FFMIN(size, 256), data);
+        return AVERROR_INVALIDDATA;
+    }
+    if (!(pkt = av_packet_alloc()))
+        return AVERROR(ENOMEM);
+    if ((ret = decoder_acquire(ctx, &dec, codec_id)) < 0) {
+        av_packet_free(&pkt);
+        return ret;
+    }
+
+    // Packets that are not refcounted are copied by avcodec_send_packet()
+    if (buf && !(pkt->buf = av_buffer_ref(buf))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    pkt->data = (uint8_t *)data;
+    pkt->size = size;
+    pkt->flags |= AV_PKT_FLAG_KEY;
+    if ((ret = avcodec_send_packet(dec, pkt)) < 0 ||
+        (ret = avcodec_receive_frame(dec, dst)) < 0)
+        av_log(ctx, AV_LOG_ERROR, "Failed to decode image\n");
+
+end:
+    av_packet_free(&pkt);
+    decoder_release(s, dec);
+    return ret;
+}
+
+static int timed_decode(AVFrame *dst, AVFilterContext *ctx, const uint8_t *data, int size,
+                        AVBufferRef *buf, WMSFrameStats *st)
+{
+    int64_t start = av_gettime_relative();
+    int ret = decode_image(dst, ctx, data, size, buf);
+
+    st->time[WMS_STAT_DECODE] += av_gettime_relative() - start;
+    return ret;
+}
+
+/**
+ * Move body to a refcounted buffer padded for the decoders, which then
+ * need not copy it.
+ *
+ * @return the length of the body, or a negative error code
+ */
+static int body_to_buffer(AVBufferRef **buf, AVBPrint *body)
+{
+    unsigned len = body->len;
+    char *str;
+    int ret;
+
+    av_bprint_chars(body, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!av_bprint_is_complete(body))
+        return AVERROR(ENOMEM);
+    if ((ret = av_bprint_finalize(body, &str)) < 0)
+        return ret;
+    if (!(*buf = av_buffer_create(str, len + AV_INPUT_BUFFER_PADDING_SIZE,
+                                  av_buffer_default_free, NULL, 0))) {
+        av_free(str);
+        return AVERROR(ENOMEM);
+    }
+    return len;
+}
+
+/**
+ * @param cache whether the response may come from and go to the disk cache
+ */
+static int download_frame(AVFrame *dst, AVFilterContext *ctx, const char* url, int cache,
+                          WMSFrameStats *st) {
+    WMSContext *s = ctx->priv;
+    WMSCacheEntry e;
+    WMSValidators v = { 0 };
+    AVBPrint body;
+    AVBufferRef *buf = NULL;
+    int len;
+    int cached = cache && s->cache_dir && disk_cache_get(ctx, url, &e);
+    int ret;
+
+    if (cached && !e.stale) {
+        // The body is mapped from the cache file, not padded
+        if ((ret = timed_decode(dst, ctx, e.body, e.body_size, NULL, st)) >= 0) {
+            st->disk_hits++;
+            goto end;
+        }
+        av_log(ctx, AV_LOG_WARNING, "Ignoring corrupted cache entry for '%s'\n", url);
+        disk_cache_release(&e);
+        cached = 0;
+    }
+
+    av_bprint_init(&body, 0, AV_BPRINT_SIZE_UNLIMITED);
+    ret = http_get(ctx, url, &body, cached ? &e : NULL, &v, st);
+    if (ret > 0) {
+        // Only the headers were sent, the entry is good for another cache_ttl
+        av_log(ctx, AV_LOG_DEBUG, "Revalidated cache entry for '%s'\n", url);
+        st->revalidated++;
+        if ((ret = timed_decode(dst, ctx, e.body, e.body_size, NULL, st)) >= 0)
+            disk_cache_put(ctx, url, e.body, e.body_size, s->cache_ttl,
+                           v.etag && *v.etag ? v.etag : e.etag,
+                           v.last_modified && *v.last_modified ? v.last_modified : e.last_modified);
+    } else if (ret == 0 && (ret = body_to_buffer(&buf, &body)) >= 0) {
+        len = ret;
+        ret = timed_decode(dst, ctx, buf->data, len, buf, st);
+        // Only cache what could be decoded, servers report errors with a 200 status
+        if (ret >= 0 && cache && s->cache_dir)
+            disk_cache_put(ctx, url, buf->data, len, s->cache_ttl, v.etag, v.last_modified);
+        av_buffer_unref(&buf);
+    }
+    av_bprint_finalize(&body, NULL);
+end:
+    if (cached)
+        disk_cache_release(&e);
+    validators_free(&v);
+    return ret;
+}
+
+/**
+ * Get the decoded response to url. A request some other frame has in
+ * flight already, in this instance or with a shared fetch service in any
+ * instance, is waited for rather than sent again.
+ *
+ * @param cache whether the response may come from and go to the disk cache
+ */
+static int get_frame(AVFrame *dst, AVFilterContext *ctx, const char *url, int cache,
+                     WMSFrameStats *st)
+{
+    WMSContext *s = ctx->priv;
+    WMSFlight *f;
+    int ret = ff_wms_flight_join(s->fetch_svc, &f, url, cache, dst);
+
+    if (ret <= 0) {
+        if (!ret)
+            st->shared_hits++;
+        return ret;
+    }
+    ret = download_frame(dst, ctx, url, cache, st);
+    ff_wms_flight_land(s->fetch_svc, f, ret, dst);
+    return ret;
+}
+
+/**
+ * Queue a job, must be called with s->lock held
+ */
+static int pool_submit(AVFilterContext *ctx, int (*func)(AVFilterContext *ctx, void *arg, int jobnr),
+                       void *arg, int jobnr, uint64_t prio, WMSBatch *batch)
+{
+    WMSContext *s = ctx->priv;
+    WMSJob **next = &s->jobs;
+    WMSJob *job = av_mallocz(sizeof(*job));
+
+    if (!job)
+        return AVERROR(ENOMEM);
+    job->func  = func;
+    job->arg   = arg;
+    job->jobnr = jobnr;
+    job->prio  = prio;
+    job->batch = batch;
+    while (*next && (*next)->prio <= prio)
+        next = &(*next)->next;
+    job->next = *next;
+    *next = job;
+    ff_cond_broadcast(&s->cond);
+    return 0;
+}
+
+/**
+ * Run a dequeued job, must be called with s->lock held, which is released
+ * while the job runs
+ */
+static void pool_run(AVFilterContext *ctx, WMSJob *job)
+{
+    WMSContext *s = ctx->priv;
+    int ret;
+
+    ff_mutex_unlock(&s->lock);
+    ret = job->func(ctx, job->arg, job->jobnr);
+    ff_mutex_lock(&s->lock);
+    if (job->batch) {
+        if (ret < 0 && !job->batch->ret)
+            job->batch->ret = ret;
+        if (!--job->batch->pending)
+            ff_cond_broadcast(&s->cond);
+    }
+    av_free(job);
+}
+
+/**
+ * Run func for jobnr 0..nb_jobs-1 on the worker pool and wait for all of
+ * them. The calling thread runs the jobs nobody picked yet, so that it can
+ * be called from a worker.
+ *
+ * @return the first error returned by a job, 0 otherwise
+ */
+static int pool_execute(AVFilterContext *ctx, int (*func)(AVFilterContext *ctx, void *arg, int jobnr),
+                        void *arg, int nb_jobs, uint64_t prio)
+{
+    WMSContext *s = ctx->priv;
+    WMSBatch batch = { 0 };
+    WMSJob **job;
+    int ret;
+
+    ff_mutex_lock(&s->lock);
+    for (int i = 0; i < nb_jobs; i++) {
+        if ((ret = pool_submit(ctx, func, arg, i, prio, &batch)) < 0) {
+            batch.ret = ret;
+            break;
+        }
+        batch.pending++;
+    }
+    while (batch.pending) {
+        for (job = &s->jobs; *job && (*job)->batch != &batch; job = &(*job)->next)
+            ;
+        if (*job) {
+            WMSJob *mine = *job;
+            *job = mine->next;
+            pool_run(ctx, mine);
+        } else {
+            ff_cond_wait(&s->cond, &s->lock);
+        }
+    }
+    ff_mutex_unlock(&s->lock);
+    return batch.ret;
+}
+
+static void *worker_thread(void *arg)
+{
+    AVFilterContext *ctx = arg;
+    WMSContext *s = ctx->priv;
+    WMSJob *job;
+
+    ff_mutex_lock(&s->lock);
+    while (!s->exiting) {
+        if (!(job = s->jobs)) {
+            ff_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        s->jobs = job->next;
+        pool_run(ctx, job);
+    }
+    ff_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static av_cold int init_pool(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    int split = (s->max_width && s->w > s->max_width) || (s->max_height && s->h > s->max_height);
+    int nb_threads = s->threads ? s->threads : s->prefetch;
+    int ret;
+
+    // Frames fetched one at a time are still fetched by a worker, so that
+    // activate() never blocks. Sub-requests need more of them.
+    if (!nb_threads)
+        nb_threads = split || s->tile_size || s->nb_split_layers ? 4 : 1;
+    s->nb_slots = s->prefetch + 1;
+    s->slots = av_calloc(s->nb_slots, sizeof(*s->slots));
+    s->maps  = av_calloc(s->nb_slots, sizeof(*s->maps));
+    if (!s->slots || !s->maps)
+        return AVERROR(ENOMEM);
+    if (!(s->workers = av_calloc(nb_threads, sizeof(*s->workers))))
+        return AVERROR(ENOMEM);
+
+    if ((ret = ff_mutex_init(&s->lock, NULL)) ||
+        (ret = ff_cond_init(&s->cond, NULL))) {
+        av_freep(&s->workers);
+        return AVERROR(ret);
+    }
+
+    for (; s->nb_workers < nb_threads; s->nb_workers++) {
+        ret = pthread_create(&s->workers[s->nb_workers], NULL, worker_thread, ctx);
+        if (ret) {
+            av_log(ctx, AV_LOG_ERROR, "pthread_create failed : %s\n", av_err2str(AVERROR(ret)));
+            return AVERROR(ret);
+        }
+    }
+    av_log(ctx, AV_LOG_DEBUG, "Using %d fetch threads, prefetching %d frames ahead\n",
+           s->nb_workers, s->prefetch);
+    return 0;
+}
+
+/**
+ * @param dims query parameters of the dimensions, may be NULL
+ */
+static char *format_getmap_url(const char *fmt, const MapReadContext *map, int w, int h,
+                               const char *dims)
+{
+    char *url = av_asprintf(fmt, map->x1, map->y1, map->x2, map->y2, w, h), *tmp;
+
+    if (!url || !dims || !*dims)
+        return url;
+    tmp = av_asprintf("%s%s", url, dims);
+    av_free(url);
+    return tmp;
+}
+
+/**
+ * Convert frame in place to pix_fmt. YUV420P is always full range, as
+ * negotiated on the output.
+ */
+static int convert_frame(AVFrame **frame, enum AVPixelFormat pix_fmt)
+{
+    // libswscale and the JPEG decoder still flag full range through the J formats
+    enum AVPixelFormat sws_fmt = pix_fmt == AV_PIX_FMT_YUV420P ? AV_PIX_FMT_YUVJ420P : pix_fmt;
+    enum AVPixelFormat src_fmt = (*frame)->format;
+    struct SwsContext *sws;
+    AVFrame *dst;
+    int ret;
+
+    if (src_fmt == AV_PIX_FMT_YUV420P && (*frame)->color_range == AVCOL_RANGE_JPEG)
+        src_fmt = AV_PIX_FMT_YUVJ420P;
+    if (src_fmt == sws_fmt) {
+        (*frame)->format = pix_fmt;
+        if (sws_fmt != pix_fmt)
+            (*frame)->color_range = AVCOL_RANGE_JPEG;
+        return 0;
+    }
+    if (!(dst = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    dst->width  = (*frame)->width;
+    dst->height = (*frame)->height;
+    dst->format = sws_fmt;
+    sws = sws_getContext(dst->width, dst->height, src_fmt,
+                         dst->width, dst->height, sws_fmt,
+                         SWS_BICUBIC, NULL, NULL, NULL);
+    if (!sws) {
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+    if ((ret = av_frame_get_buffer(dst, 0)) < 0 ||
+        (ret = sws_scale_frame(sws, dst, *frame)) < 0)
+        goto fail;
+    sws_freeContext(sws);
+    av_frame_free(frame);
+    dst->format = pix_fmt;
+    if (sws_fmt != pix_fmt)
+        dst->color_range = AVCOL_RANGE_JPEG;
+    *frame = dst;
+    return 0;
+fail:
+    sws_freeContext(sws);
+    av_frame_free(&dst);
+    return ret;
+}
+
+/**
+ * Bilinear resampling of a packed image with 4 bytes per pixel.
+ * sx[i] (resp. sy[j]) is the position in src of the center of the output
+ * column i (resp. row j), in pixels. Positions outside src are clamped.
+ */
+static int resample_bilinear(uint8_t *dst, int dst_linesize, int w, int h,
+                             const uint8_t *src, int src_linesize, int src_w, int src_h,
+                             const float *sx, const float *sy)
+{
+    int *xi = av_malloc_array(w, 2 * sizeof(*xi)), *xf = xi + w;
+
+    if (!xi)
+        return AVERROR(ENOMEM);
+    for (int i = 0; i < w; i++) {
+        float x = av_clipf(sx[i] - 0.5f, 0, src_w - 1);
+        xi[i] = FFMIN((int)x, src_w - 2 < 0 ? 0 : src_w - 2);
+        xf[i] = src_w > 1 ? lrintf((x - xi[i]) * 256) : 0;
+    }
+
+    for (int j = 0; j < h; j++) {
+        float y = av_clipf(sy[j] - 0.5f, 0, src_h - 1);
+        int yi = FFMIN((int)y, src_h - 2 < 0 ? 0 : src_h - 2);
+        int yf = src_h > 1 ? lrintf((y - yi) * 256) : 0;
+        const uint8_t *row0 = src + yi * src_linesize;
+        const uint8_t *row1 = src_h > 1 ? row0 + src_linesize : row0;
+        uint8_t *out = dst + j * dst_linesize;
+
+        for (int i = 0; i < w; i++) {
+            const uint8_t *p0 = row0 + 4 * xi[i], *p1 = row1 + 4 * xi[i];
+            int fx = xf[i];
+            for (int c = 0; c < 4; c++) {
+                int top = p0[c] * 256 + (p0[c + 4] - p0[c]) * fx;
+                int bot = p1[c] * 256 + (p1[c + 4] - p1[c]) * fx;
+                out[4 * i + c] = (top * 256 + (bot - top) * yf + (1 << 15)) >> 16;
             }
-            src_c++;
-            dst_c++;
         }
-        *dst_c = *src_c;
-        if (force_flag !=  15){
-            av_log(ctx, AV_LOG_ERROR, "Forced URL should contain '{x1}', '{y1}', '{x2}' and '{y2}'\n" );
-            return -1;
+    }
+    av_free(xi);
+    return 0;
+}
+
+/*
+ * Tile mode: the globe is split in a power-of-two pyramid of square tiles,
+ * like the global-geodetic profile of TMS. Level z has 2^(z+1) x 2^z tiles
+ * of WMS_GRID_SPAN / 2^z degrees, starting at the south-west corner of the
+ * globe. Tiles always have the same bbox and size whatever the frame, so
+ * they can be cached and shared between frames.
+ */
+#define WMS_GRID_LON0     -180.0
+#define WMS_GRID_LAT0      -90.0
+#define WMS_GRID_SPAN      180.0
+#define WMS_GRID_MAX_LEVEL 30
+#define WMS_MAX_TILES      256
+#define WMS_TILE_PIX_FMT   AV_PIX_FMT_RGBA
+
+/**
+ * Bbox split by image axes: h0/h1 are the west/east bounds, v0/v1 the
+ * south/north ones
+ */
+typedef struct WMSExtent {
+    double h0, h1, v0, v1;
+} WMSExtent;
+
+/**
+ * WMS 1.3.0 uses the lat/lon axis order of EPSG:4326, so the first bbox
+ * axis is the vertical one.
+ */
+static int swapped_axes(const WMSContext *s)
+{
+    return s->wms_version == WMS_V1_3_0;
+}
+
+static WMSExtent map_to_extent(const WMSContext *s, const MapReadContext *map)
+{
+    double h1 = swapped_axes(s) ? map->y1 : map->x1, h2 = swapped_axes(s) ? map->y2 : map->x2;
+    double v1 = swapped_axes(s) ? map->x1 : map->y1, v2 = swapped_axes(s) ? map->x2 : map->y2;
+    return (WMSExtent){ FFMIN(h1, h2), FFMAX(h1, h2), FFMIN(v1, v2), FFMAX(v1, v2) };
+}
+
+static MapReadContext extent_to_map(const WMSContext *s, const WMSExtent *e)
+{
+    return swapped_axes(s) ? (MapReadContext){ e->v0, e->h0, e->v1, e->h1 }
+                           : (MapReadContext){ e->h0, e->v0, e->h1, e->v1 };
+}
+
+/**
+ * Resample the part of src, which covers se, that dst covers
+ */
+static int resample_extent(AVFrame *dst, const WMSExtent *de,
+                           const AVFrame *src, const WMSExtent *se)
+{
+    double scale_h = src->width  / (se->h1 - se->h0);
+    double scale_v = src->height / (se->v1 - se->v0);
+    float *sx = av_malloc_array(dst->width + dst->height, sizeof(*sx)), *sy;
+    int ret;
+
+    if (!sx)
+        return AVERROR(ENOMEM);
+    sy = sx + dst->width;
+    for (int i = 0; i < dst->width; i++)
+        sx[i] = (de->h0 + (i + 0.5) * (de->h1 - de->h0) / dst->width - se->h0) * scale_h;
+    for (int j = 0; j < dst->height; j++)
+        sy[j] = (se->v1 - (de->v1 - (j + 0.5) * (de->v1 - de->v0) / dst->height)) * scale_v;
+    ret = resample_bilinear(dst->data[0], dst->linesize[0], dst->width, dst->height,
+                            src->data[0], src->linesize[0], src->width, src->height, sx, sy);
+    av_free(sx);
+    return ret;
+}
+
+static char *tile_url(WMSContext *s, int z, int64_t tx, int64_t ty)
+{
+    double span = WMS_GRID_SPAN / (1LL << z);
+    WMSExtent e = { WMS_GRID_LON0 + tx * span, WMS_GRID_LON0 + (tx + 1) * span,
+                    WMS_GRID_LAT0 + ty * span, WMS_GRID_LAT0 + (ty + 1) * span };
+    MapReadContext map;
+
+    if (s->tile_service)
+        return av_asprintf(s->fmt_url, s->matrices[z].id, tx, ty);
+    map = extent_to_map(s, &e);
+    return format_getmap_url(s->fmt_url, &map, s->tile_size, s->tile_size, NULL);
+}
+
+/**
+ * Get tile tx, ty of level z, of the WMS grid or of the tile service
+ */
+static int fetch_tile(AVFrame **out, AVFilterContext *ctx, int z, int64_t tx, int64_t ty,
+                      WMSFrameStats *st)
+{
+    WMSContext *s = ctx->priv;
+    int tile_w = s->tile_service ? s->matrices[z].tile_w : s->tile_size;
+    int tile_h = s->tile_service ? s->matrices[z].tile_h : s->tile_size;
+    char *url = tile_url(s, z, tx, ty);
+    AVFrame *tile = NULL;
+#if HAVE_MMAP
+    WMSShmLock *lock = NULL;
+    uint64_t key[2];
+#endif
+    int ret;
+
+    if (!url)
+        return AVERROR(ENOMEM);
+    // The URL identifies the tile, also for the other instances of a shared cache
+    if ((ret = ff_wms_frame_cache_claim(s->frame_cache, url, out)) <= 0) {
+        av_free(url);
+        return ret;
+    }
+#if HAVE_MMAP
+    if (s->shm) {
+        shm_key(url, key);
+        if ((ret = shm_cache_get(ctx, key, &tile, tile_w, tile_h, &lock)) < 0)
+            goto fail;
+        if (ret) {
+            st->shm_hits++;
+            goto done;
+        }
+    }
+#endif
+    if (!(tile = av_frame_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if ((ret = get_frame(tile, ctx, url, 1, st)) < 0 ||
+        (ret = convert_frame(&tile, WMS_TILE_PIX_FMT)) < 0)
+        goto fail;
+    if (tile->width != tile_w || tile->height != tile_h) {
+        av_log(ctx, AV_LOG_ERROR, "Server returned a %dx%d image for a %dx%d tile\n",
+               tile->width, tile->height, tile_w, tile_h);
+        ret = AVERROR_INVALIDDATA;
+        goto fail;
+    }
+#if HAVE_MMAP
+    if (s->shm) {
+        shm_cache_put(s, key, tile);
+        shm_cache_unlock(lock, key);
+    }
+done:
+#endif
+    ff_wms_frame_cache_put(s->frame_cache, url, tile);
+    av_free(url);
+    *out = tile;
+    return 0;
+fail:
+#if HAVE_MMAP
+    if (s->shm)
+        shm_cache_unlock(lock, key);
+#endif
+    ff_wms_frame_cache_abort(s->frame_cache, url);
+    av_free(url);
+    av_frame_free(&tile);
+    return ret;
+}
+
+/**
+ * Tiles of a level assembled in a single image, its row r holds the tiles
+ * of row ty0 + r * ty_step
+ */
+typedef struct WMSMosaic {
+    AVFrame *frame;
+    int z, cols;
+    int64_t tx0, ty0;
+    int ty_step;
+    int tile_w, tile_h;
+    WMSFrameStats st;
+} WMSMosaic;
+
+static int fetch_tile_job(AVFilterContext *ctx, void *arg, int jobnr)
+{
+    WMSContext *s = ctx->priv;
+    WMSMosaic *m = arg;
+    int r = jobnr / m->cols, c = jobnr % m->cols;
+    AVFrame *tile;
+    WMSFrameStats st = { 0 };
+    int ret;
+
+    ret = fetch_tile(&tile, ctx, m->z, m->tx0 + c, m->ty0 + r * m->ty_step, &st);
+    stats_merge(s, &m->st, &st);
+    if (ret < 0)
+        return ret;
+    av_image_copy_plane(m->frame->data[0] + r * m->tile_h * m->frame->linesize[0] + 4 * c * m->tile_w,
+                        m->frame->linesize[0], tile->data[0], tile->linesize[0],
+                        4 * m->tile_w, m->tile_h);
+    av_frame_free(&tile);
+    return 0;
+}
+
+/**
+ * Grow the default tile cache budget to twice the tiles of the mosaic: the
+ * grid may be finer than the output on one axis.
+ */
+static void grow_tile_cache(WMSContext *s, const WMSMosaic *m, int rows)
+{
+    int64_t size = 2LL * m->cols * rows * m->tile_w * m->tile_h * 4;
+
+    ff_wms_frame_cache_reserve(s->frame_cache, &s->frame_cache_size, size);
+}
+
+static int fetch_mosaic(AVFilterContext *ctx, WMSMosaic *m, int rows, uint64_t pts)
+{
+    WMSContext *s = ctx->priv;
+    int ret;
+
+    av_log(ctx, AV_LOG_DEBUG, "Using %dx%d tiles of level %d\n", m->cols, rows, m->z);
+    if (s->frame_cache_auto)
+        grow_tile_cache(s, m, rows);
+    if (!(m->frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    m->frame->width  = m->cols * m->tile_w;
+    m->frame->height = rows * m->tile_h;
+    m->frame->format = WMS_TILE_PIX_FMT;
+    if ((ret = av_frame_get_buffer(m->frame, 0)) < 0 ||
+        (ret = pool_execute(ctx, fetch_tile_job, m, m->cols * rows, pts)) < 0)
+        av_frame_free(&m->frame);
+    return ret;
+}
+
+static double lon_to_mercator(double lon)
+{
+    return WMS_MERCATOR_R * lon * M_PI / 180;
+}
+
+static double lat_to_mercator(double lat)
+{
+    lat = av_clipd(lat, -WMS_MERCATOR_LAT, WMS_MERCATOR_LAT);
+    return WMS_MERCATOR_R * log(tan(M_PI / 4 + lat * M_PI / 360));
+}
+
+/**
+ * Build the frame for map from the tiles of the coarsest Web Mercator
+ * level whose resolution is at least the output one. Frames are in
+ * longitude and latitude, which Web Mercator maps independently to
+ * columns and rows, so the reprojection is a separable resampling.
+ */
+static int fetch_tiled_mercator(AVFrame **out, AVFilterContext *ctx, const WMSSlot *slot,
+                                WMSFrameStats *st)
+{
+    WMSContext *s = ctx->priv;
+    WMSExtent e = map_to_extent(s, &slot->map);
+    double x0 = lon_to_mercator(e.h0), x1 = lon_to_mercator(e.h1);
+    double y0 = lat_to_mercator(e.v0), y1 = lat_to_mercator(e.v1);
+    double res = FFMIN((x1 - x0) / s->w, (y1 - y0) / s->h), left, top;
+    const WMSTileMatrix *tm;
+    WMSMosaic m = { .ty_step = 1 };
+    int64_t cols, rows;
+    AVFrame *frame = NULL;
+    float *sx = NULL, *sy;
+    int ret;
+
+    if (res <= 0) {
+        av_log(ctx, AV_LOG_ERROR, "Empty bbox\n");
+        return AVERROR(EINVAL);
+    }
+    // Allow for rounding errors, so that matching levels are picked
+    for (m.z = 0; m.z < s->nb_matrices - 1 && s->matrices[m.z].res > res * 1.01; m.z++)
+        ;
+    for (;; m.z--) {
+        double tw, th;
+        tm = &s->matrices[m.z];
+        tw = tm->tile_w * tm->res;
+        th = tm->tile_h * tm->res;
+        m.tx0 = av_clip64(floor((x0 - tm->x0) / tw), 0, tm->cols - 1);
+        m.ty0 = av_clip64(floor((tm->y0 - y1) / th), 0, tm->rows - 1);
+        cols  = av_clip64(ceil((x1 - tm->x0) / tw) - 1, m.tx0, tm->cols - 1) - m.tx0 + 1;
+        rows  = av_clip64(ceil((tm->y0 - y0) / th) - 1, m.ty0, tm->rows - 1) - m.ty0 + 1;
+        if (cols * rows <= WMS_MAX_TILES || !m.z)
+            break;
+    }
+    if (cols * rows > WMS_MAX_TILES) {
+        av_log(ctx, AV_LOG_ERROR, "Bbox covers too many tiles\n");
+        return AVERROR(EINVAL);
+    }
+    m.cols   = cols;
+    m.tile_w = tm->tile_w;
+    m.tile_h = tm->tile_h;
+    if ((ret = fetch_mosaic(ctx, &m, rows, slot->pts)) < 0)
+        return ret;
+    stats_add(st, &m.st);
+
+    frame = av_frame_alloc();
+    sx    = av_malloc_array(s->w + s->h, sizeof(*sx));
+    if (!frame || !sx) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    frame->width  = s->w;
+    frame->height = s->h;
+    frame->format = WMS_TILE_PIX_FMT;
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0)
+        goto end;
+
+    left = tm->x0 + m.tx0 * m.tile_w * tm->res;
+    top  = tm->y0 - m.ty0 * m.tile_h * tm->res;
+    sy   = sx + s->w;
+    for (int i = 0; i < s->w; i++)
+        sx[i] = (lon_to_mercator(e.h0 + (i + 0.5) * (e.h1 - e.h0) / s->w) - left) / tm->res;
+    for (int j = 0; j < s->h; j++)
+        sy[j] = (top - lat_to_mercator(e.v1 - (j + 0.5) * (e.v1 - e.v0) / s->h)) / tm->res;
+    if ((ret = resample_bilinear(frame->data[0], frame->linesize[0], s->w, s->h,
+                                 m.frame->data[0], m.frame->linesize[0], m.frame->width, m.frame->height,
+                                 sx, sy)) < 0)
+        goto end;
+
+    *out  = frame;
+    frame = NULL;
+end:
+    av_free(sx);
+    av_frame_free(&m.frame);
+    av_frame_free(&frame);
+    return ret;
+}
+
+/**
+ * Build the frame for map from the tiles of the smallest pyramid level
+ * whose resolution is at least the output one.
+ */
+static int fetch_tiled(AVFrame **out, AVFilterContext *ctx, const WMSSlot *slot,
+                       WMSFrameStats *st)
+{
+    WMSContext *s = ctx->priv;
+    WMSExtent e = map_to_extent(s, &slot->map);
+    double res = FFMIN((e.h1 - e.h0) / s->w, (e.v1 - e.v0) / s->h);
+    WMSMosaic m = { .ty_step = -1, .tile_w = s->tile_size, .tile_h = s->tile_size };
+    WMSExtent me;
+    int64_t tx1, ty0;
+    double span;
+    int rows, ret;
+    AVFrame *frame = NULL;
+
+    if (s->tile_service)
+        return fetch_tiled_mercator(out, ctx, slot, st);
+    if (res <= 0) {
+        av_log(ctx, AV_LOG_ERROR, "Empty bbox\n");
+        return AVERROR(EINVAL);
+    }
+    m.z = av_clip(ceil(log2(WMS_GRID_SPAN / (s->tile_size * res))), 0, WMS_GRID_MAX_LEVEL);
+    for (;; m.z--) {
+        int64_t nb_rows = 1LL << m.z;
+        span  = WMS_GRID_SPAN / nb_rows;
+        // Only tiles of the globe are requested, the frame edges are
+        // stretched over what is outside of it
+        m.tx0 = av_clip64(floor((e.h0 - WMS_GRID_LON0) / span), 0, 2 * nb_rows - 1);
+        tx1   = av_clip64(ceil((e.h1 - WMS_GRID_LON0) / span) - 1, m.tx0, 2 * nb_rows - 1);
+        ty0   = av_clip64(floor((e.v0 - WMS_GRID_LAT0) / span), 0, nb_rows - 1);
+        // Images go north to south: the first mosaic row holds the top tiles
+        m.ty0 = av_clip64(ceil((e.v1 - WMS_GRID_LAT0) / span) - 1, ty0, nb_rows - 1);
+        m.cols = tx1 - m.tx0 + 1;
+        rows   = m.ty0 - ty0 + 1;
+        if (m.cols * rows <= WMS_MAX_TILES || !m.z)
+            break;
+    }
+    if (m.cols * rows > WMS_MAX_TILES) {
+        av_log(ctx, AV_LOG_ERROR, "Bbox covers too many tiles\n");
+        return AVERROR(EINVAL);
+    }
+    if ((ret = fetch_mosaic(ctx, &m, rows, slot->pts)) < 0)
+        return ret;
+    stats_add(st, &m.st);
+
+    if (!(frame = av_frame_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    frame->width  = s->w;
+    frame->height = s->h;
+    frame->format = WMS_TILE_PIX_FMT;
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0)
+        goto end;
+
+    me = (WMSExtent){ WMS_GRID_LON0 + m.tx0 * span, WMS_GRID_LON0 + (tx1 + 1) * span,
+                      WMS_GRID_LAT0 + ty0 * span, WMS_GRID_LAT0 + (m.ty0 + 1) * span };
+    if ((ret = resample_extent(frame, &e, m.frame, &me)) < 0)
+        goto end;
+
+    *out = frame;
+    frame = NULL;
+end:
+    av_frame_free(&m.frame);
+    av_frame_free(&frame);
+    return ret;
+}
+
+/**
+ * Frame too large for a single request, split in cols x rows sub-requests
+ */
+typedef struct WMSSplit {
+    AVFrame *frame;
+    const char *fmt;        ///< GetMap URL format
+    const char *dims;       ///< query parameters of the dimensions
+    int cache;
+    WMSExtent e;
+    int cols, rows;
+    WMSFrameStats st;
+} WMSSplit;
+
+static int fetch_split_job(AVFilterContext *ctx, void *arg, int jobnr)
+{
+    WMSContext *s = ctx->priv;
+    WMSSplit *sp = arg;
+    int c = jobnr % sp->cols, r = jobnr / sp->cols;
+    int x0 = c * s->w / sp->cols, x1 = (c + 1) * s->w / sp->cols;
+    int y0 = r * s->h / sp->rows, y1 = (r + 1) * s->h / sp->rows;
+    WMSExtent sub = {
+        sp->e.h0 + x0 * (sp->e.h1 - sp->e.h0) / s->w, sp->e.h0 + x1 * (sp->e.h1 - sp->e.h0) / s->w,
+        sp->e.v1 - y1 * (sp->e.v1 - sp->e.v0) / s->h, sp->e.v1 - y0 * (sp->e.v1 - sp->e.v0) / s->h,
+    };
+    MapReadContext map = extent_to_map(s, &sub);
+    AVFrame *part = av_frame_alloc();
+    char *url = format_getmap_url(sp->fmt, &map, x1 - x0, y1 - y0, sp->dims);
+    WMSFrameStats st = { 0 };
+    int ret;
+
+    if (!part || !url) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ret = get_frame(part, ctx, url, sp->cache, &st);
+    stats_merge(s, &sp->st, &st);
+    if (ret < 0 || (ret = convert_frame(&part, sp->frame->format)) < 0)
+        goto end;
+    if (part->width != x1 - x0 || part->height != y1 - y0) {
+        av_log(ctx, AV_LOG_ERROR, "Server returned a %dx%d image for a %dx%d request\n",
+               part->width, part->height, x1 - x0, y1 - y0);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    av_image_copy_plane(sp->frame->data[0] + y0 * sp->frame->linesize[0] + 4 * x0,
+                        sp->frame->linesize[0], part->data[0], part->linesize[0],
+                        4 * part->width, part->height);
+end:
+    av_free(url);
+    av_frame_free(&part);
+    return ret;
+}
+
+static int fetch_split(AVFrame **out, AVFilterContext *ctx, const WMSSlot *slot,
+                       const char *fmt, const char *dims, int cache, WMSFrameStats *st)
+{
+    WMSContext *s = ctx->priv;
+    WMSSplit sp = {
+        .fmt   = fmt,
+        .dims  = dims,
+        .cache = cache,
+        .e     = map_to_extent(s, &slot->map),
+        .cols  = s->max_width  ? (s->w + s->max_width  - 1) / s->max_width  : 1,
+        .rows  = s->max_height ? (s->h + s->max_height - 1) / s->max_height : 1,
+    };
+    int ret;
+
+    av_log(ctx, AV_LOG_DEBUG, "Splitting frame in %dx%d requests\n", sp.cols, sp.rows);
+    if (!(sp.frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    sp.frame->width  = s->w;
+    sp.frame->height = s->h;
+    sp.frame->format = WMS_TILE_PIX_FMT;
+    if ((ret = av_frame_get_buffer(sp.frame, 0)) < 0 ||
+        (ret = pool_execute(ctx, fetch_split_job, &sp, sp.cols * sp.rows, slot->pts)) < 0) {
+        av_frame_free(&sp.frame);
+        return ret;
+    }
+    stats_add(st, &sp.st);
+    *out = sp.frame;
+    return 0;
+}
+
+// Exact x / 255 for x in [0, 255 * 255]
+#define DIV255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+
+/**
+ * Composite a straight alpha RGBA image over a premultiplied one
+ */
+static void blend_over(uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                       int w, int h)
+{
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < 4 * w; i += 4) {
+            unsigned a = src[i + 3], na = 255 - a;
+            dst[i + 0] = DIV255(src[i + 0] * a + dst[i + 0] * na);
+            dst[i + 1] = DIV255(src[i + 1] * a + dst[i + 1] * na);
+            dst[i + 2] = DIV255(src[i + 2] * a + dst[i + 2] * na);
+            dst[i + 3] = DIV255(a * 255        + dst[i + 3] * na);
+        }
+        dst += dst_linesize;
+        src += src_linesize;
+    }
+}
+
+static void unpremultiply(uint8_t *data, int linesize, int w, int h)
+{
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < 4 * w; i += 4) {
+            unsigned a = data[i + 3];
+            if (a && a < 255)
+                for (int c = 0; c < 3; c++)
+                    data[i + c] = FFMIN((data[i + c] * 255 + a / 2) / a, 255);
+        }
+        data += linesize;
+    }
+}
+
+/**
+ * Images of the split layers of a frame, bottom first
+ */
+typedef struct WMSLayers {
+    const WMSSlot *slot;
+    AVFrame **frames;
+    WMSFrameStats st;
+} WMSLayers;
+
+static int fetch_layer_job(AVFilterContext *ctx, void *arg, int jobnr)
+{
+    WMSContext *s = ctx->priv;
+    WMSLayers *l = arg;
+    int cache = !s->layer_dynamic[jobnr];
+    char *key = NULL, *url = NULL, dims[sizeof(l->slot->dims)];
+    AVFrame *frame = NULL;
+    WMSFrameStats st = { 0 };
+    int ret;
+
+    // Only the dimensions the layer has, so that the others do not vary
+    dims_query(dims, sizeof(dims), l->slot, s->layer_dims[jobnr]);
+    if (cache && s->frame_cache && s->cache_layers) {
+        if (!(key = frame_cache_key(s, s->layer_fmts[jobnr], &l->slot->map, dims)))
+            return AVERROR(ENOMEM);
+        if ((l->frames[jobnr] = ff_wms_frame_cache_get(s->frame_cache, key))) {
+            ret = 0;
+            goto end;
         }
-        return 0;
     }
-    return 1;
+
+    if ((s->max_width && s->w > s->max_width) || (s->max_height && s->h > s->max_height)) {
+        ret = fetch_split(&frame, ctx, l->slot, s->layer_fmts[jobnr], dims, cache, &st);
+    } else if (!(frame = av_frame_alloc()) ||
+               !(url = format_getmap_url(s->layer_fmts[jobnr], &l->slot->map, s->w, s->h, dims))) {
+        ret = AVERROR(ENOMEM);
+    } else {
+        ret = get_frame(frame, ctx, url, cache, &st);
+    }
+    if (ret < 0 || (ret = convert_frame(&frame, WMS_TILE_PIX_FMT)) < 0)
+        goto end;
+    if (frame->width != s->w || frame->height != s->h) {
+        av_log(ctx, AV_LOG_ERROR, "Server returned a %dx%d image for a %dx%d request\n",
+               frame->width, frame->height, s->w, s->h);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    if (key)
+        ff_wms_frame_cache_put(s->frame_cache, key, frame);
+    l->frames[jobnr] = frame;
+    frame = NULL;
+end:
+    stats_merge(s, &l->st, &st);
+    av_frame_free(&frame);
+    av_free(url);
+    av_free(key);
+    return ret;
 }
 
-static int init_format(AVFilterContext *ctx) {
+/**
+ * Fetch the layers of a frame concurrently and composite them in order
+ */
+static int fetch_layers(AVFrame **out, AVFilterContext *ctx, const WMSSlot *slot,
+                        WMSFrameStats *st)
+{
     WMSContext *s = ctx->priv;
-
+    WMSLayers l = { .slot = slot };
+    AVFrame *frame = NULL;
     int ret;
-    //Needs escaping: service , layers
-    char *service = format_url_arg(s->service);
-    char *layers = format_url_arg(s->layers);
 
-    if (service == NULL) {
-        av_log(ctx, AV_LOG_ERROR,
-       "Could not escape 'service' URL param\n");
-        ret = EINVAL;
-        goto fail;
-    }
+    if (!(l.frames = av_calloc(s->nb_split_layers, sizeof(*l.frames))))
+        return AVERROR(ENOMEM);
+    ret = pool_execute(ctx, fetch_layer_job, &l, s->nb_split_layers, slot->pts);
+    stats_add(st, &l.st);
+    if (ret < 0)
+        goto end;
 
-    if (layers == NULL) {
-        av_log(ctx, AV_LOG_ERROR,
-    "Could not escape 'layers' arg for URL\n");
-        ret = EINVAL;
-        goto fail;
+    if (!(frame = av_frame_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
     }
+    frame->width  = s->w;
+    frame->height = s->h;
+    frame->format = WMS_TILE_PIX_FMT;
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0)
+        goto end;
+    for (int j = 0; j < s->h; j++)
+        memset(frame->data[0] + j * frame->linesize[0], 0, 4 * s->w);
+    for (int i = 0; i < s->nb_split_layers; i++)
+        blend_over(frame->data[0], frame->linesize[0],
+                   l.frames[i]->data[0], l.frames[i]->linesize[0], s->w, s->h);
+    unpremultiply(frame->data[0], frame->linesize[0], s->w, s->h);
+    *out  = frame;
+    frame = NULL;
+end:
+    for (int i = 0; i < s->nb_split_layers; i++)
+        av_frame_free(&l.frames[i]);
+    av_free(l.frames);
+    av_frame_free(&frame);
+    return ret;
+}
 
-    switch (s->wms_version) {
-        case WMS_V1_3_0:
-            s->fmt_url = av_asprintf(WMS_1_3_0_REQARGS, s->url,
-                service, s->version, WMS_REQVAL_REQUEST,
-                layers, WMS_REQVAL_STYLES, WMS_REQVAL_FORMAT,
-                s->w, s->h, WMS_REQVAL_PROJ
-                );
-            break;
-        default:
-            s->fmt_url = av_asprintf(WMS_1_1_X_REQARGS, s->url,
-                service, s->version, WMS_REQVAL_REQUEST,
-                layers, WMS_REQVAL_STYLES, WMS_REQVAL_FORMAT,
-                s->w, s->h, WMS_REQVAL_PROJ
-                );
-            break;
+static void keyframe_free(WMSKeyframe *k)
+{
+    av_frame_free(&k->frame);
+    *k = (WMSKeyframe){ .group = -1 };
+}
+
+/**
+ * Reserve the keyframe entry of group for one more of its frames, and
+ * complete the previous group, whose entry is freed once its last frame
+ * is done.
+ *
+ * @return 0, or 1 if the entry is still in use and the frame must be
+ *         fetched directly
+ */
+static int keyframe_ref(WMSContext *s, int64_t group)
+{
+    WMSKeyframe *k = &s->keys[group % s->nb_keys];
+    int ret = 0;
+
+    ff_mutex_lock(&s->key_lock);
+    if (group != s->open_group) {
+        WMSKeyframe *prev = s->open_group >= 0 ? &s->keys[s->open_group % s->nb_keys] : NULL;
+
+        if (prev && prev->group == s->open_group) {
+            prev->complete = 1;
+            if (!prev->pending)
+                keyframe_free(prev);
+        }
+        s->open_group = group;
+        if (k->group < 0)
+            k->group = group;
     }
+    if (k->group == group)
+        k->pending++;
+    else
+        ret = 1;
+    ff_mutex_unlock(&s->key_lock);
+    return ret;
+}
 
-    av_log(ctx, AV_LOG_DEBUG,"WMS URL format: %s", s->fmt_url);
-    av_free(service);
-    av_free(layers);
+/**
+ * Account a frame of group as done
+ */
+static void keyframe_unref(WMSContext *s, int64_t group)
+{
+    WMSKeyframe *k = &s->keys[group % s->nb_keys];
 
-    if (strlen(s->fmt_url) <= 0) {
-        av_log(ctx, AV_LOG_ERROR,
-       "Could not build URL\n");
-        ret = AVERROR(EIO);
-        goto fail;
+    ff_mutex_lock(&s->key_lock);
+    if (k->group == group && !--k->pending && k->complete)
+        keyframe_free(k);
+    ff_mutex_unlock(&s->key_lock);
+}
+
+/**
+ * Get the keyframe of the group of slot, waiting for it if another frame
+ * is fetching it already
+ */
+static int get_keyframe(AVFrame **out, AVFilterContext *ctx, const WMSSlot *slot,
+                        WMSFrameStats *st)
+{
+    WMSContext *s = ctx->priv;
+    // Reserved to the group until all its frames are done
+    WMSKeyframe *k = &s->keys[slot->key_group % s->nb_keys];
+    AVFrame *frame = NULL, *cached;
+    char *url, *key = NULL;
+    int ret;
+
+    ff_mutex_lock(&s->key_lock);
+    while (k->loading)
+        ff_cond_wait(&s->key_cond, &s->key_lock);
+    if (k->frame) {
+        *out = av_frame_clone(k->frame);
+        ff_mutex_unlock(&s->key_lock);
+        return *out ? 0 : AVERROR(ENOMEM);
     }
-    return 0;
-fail:
-    av_free(service);
-    av_free(layers);
+    k->loading = 1;
+    ff_mutex_unlock(&s->key_lock);
+
+    av_log(ctx, AV_LOG_DEBUG, "Fetching %dx%d keyframe for pts %"PRIu64"\n",
+           slot->key_w, slot->key_h, slot->pts);
+    // Cropped frames are output as is, resampled ones need RGBA
+    if (!(frame = av_frame_alloc()) ||
+        !(url = format_getmap_url(s->fmt_url, &slot->key_map, slot->key_w, slot->key_h, NULL))) {
+        ret = AVERROR(ENOMEM);
+    } else {
+        // The frames cropped from an overfetched keyframe reference all of
+        // it, so it is cached once rather than them
+        if (s->frame_cache && s->overfetch &&
+            !(key = av_asprintf("%s|%s", av_get_pix_fmt_name(s->pix_fmt), url))) {
+            ret = AVERROR(ENOMEM);
+        } else if (key && (cached = ff_wms_frame_cache_get(s->frame_cache, key))) {
+            av_frame_free(&frame);
+            frame = cached;
+            st->frame_cache_hit = 1;
+            ret = 0;
+        } else if ((ret = get_frame(frame, ctx, url, 1, st)) >= 0 &&
+                   (ret = convert_frame(&frame, s->overfetch ? s->pix_fmt : WMS_TILE_PIX_FMT)) >= 0 &&
+                   (frame->width != slot->key_w || frame->height != slot->key_h)) {
+            av_log(ctx, AV_LOG_ERROR, "Server returned a %dx%d image for a %dx%d keyframe\n",
+                   frame->width, frame->height, slot->key_w, slot->key_h);
+            ret = AVERROR_INVALIDDATA;
+        } else if (ret >= 0 && key) {
+            ff_wms_frame_cache_put(s->frame_cache, key, frame);
+        }
+        av_free(url);
+        av_free(key);
+    }
+    if (ret >= 0 && !(*out = av_frame_clone(frame)))
+        ret = AVERROR(ENOMEM);
+    if (ret < 0)
+        av_frame_free(&frame);
+
+    // On failure, the next frame of the group tries again
+    ff_mutex_lock(&s->key_lock);
+    k->frame   = frame;
+    k->loading = 0;
+    ff_cond_broadcast(&s->key_cond);
+    ff_mutex_unlock(&s->key_lock);
     return ret;
 }
 
-static av_cold int init(AVFilterContext *ctx)
+/**
+ * Synthesize the frame of slot from the keyframe of its group
+ */
+static int fetch_interpolated(AVFrame **out, AVFilterContext *ctx, const WMSSlot *slot,
+                              WMSFrameStats *st)
 {
+    WMSContext *s = ctx->priv;
+    WMSExtent e = map_to_extent(s, &slot->map), ke = map_to_extent(s, &slot->key_map);
+    AVFrame *key, *frame;
     int ret;
 
-    if((ret = init_format_force(ctx)) < 0)
+    if ((ret = get_keyframe(&key, ctx, slot, st)) < 0)
         return ret;
-    if(ret == 0) {
-        av_log(ctx, AV_LOG_DEBUG, "Forcing url format: %s\n", ((WMSContext*) ctx->priv)->fmt_url);
-        return 0;
+    if (!(frame = av_frame_alloc())) {
+        av_frame_free(&key);
+        return AVERROR(ENOMEM);
     }
+    frame->width  = s->w;
+    frame->height = s->h;
+    frame->format = WMS_TILE_PIX_FMT;
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0 ||
+        (ret = resample_extent(frame, &e, key, &ke)) < 0)
+        av_frame_free(&frame);
+    av_frame_free(&key);
+    *out = frame;
+    return ret;
+}
+
+/**
+ * Crop the frame of slot from its overfetched keyframe, without copying it
+ */
+static int fetch_cropped(AVFrame **out, AVFilterContext *ctx, const WMSSlot *slot,
+                         WMSFrameStats *st)
+{
+    WMSContext *s = ctx->priv;
+    AVFrame *frame;
+    int ret;
 
-    if ((ret=parse_getcapabilities(ctx))<0)
+    if ((ret = get_keyframe(&frame, ctx, slot, st)) < 0)
         return ret;
-    if((ret = init_version(ctx)) < 0)
+    frame->crop_left   = slot->key_x;
+    frame->crop_right  = frame->width - s->w - slot->key_x;
+    frame->crop_top    = slot->key_y;
+    frame->crop_bottom = frame->height - s->h - slot->key_y;
+    if ((ret = av_frame_apply_cropping(frame, AV_FRAME_CROP_UNALIGNED)) < 0) {
+        av_frame_free(&frame);
         return ret;
-    if((ret = init_format(ctx)) < 0)
+    }
+    *out = frame;
+    return 0;
+}
+
+/**
+ * @param st set to what getting the frame took
+ */
+static int fetch_frame(AVFrame **out, AVFilterContext *ctx, const WMSSlot *slot,
+                       WMSFrameStats *st) {
+    WMSContext *s = ctx->priv;
+    int64_t start = av_gettime_relative();
+    char *key = NULL, dims[sizeof(slot->dims)];
+    AVFrame *frame;
+    int ret;
+
+    *st = (WMSFrameStats){ 0 };
+    dims_query(dims, sizeof(dims), slot, (1 << WMS_DIM_NB) - 1);
+    if (s->tile_size) {
+        if ((ret = fetch_tiled(out, ctx, slot, st)) < 0 ||
+            (ret = convert_frame(out, s->pix_fmt)) < 0)
+            av_frame_free(out);
+        st->time[WMS_STAT_FETCH] = av_gettime_relative() - start;
         return ret;
+    }
 
-    av_log(ctx, AV_LOG_DEBUG, "Successfully initialized WMS Context from GetCapabilities\n");
-    return 0;
+    // Cropped frames are cached through their keyframe
+    if (s->frame_cache && !s->cache_layers && !(slot->key_w && s->overfetch)) {
+        if (!(key = frame_cache_key(s, s->fmt_url, &slot->map, dims)))
+            return AVERROR(ENOMEM);
+        if ((*out = ff_wms_frame_cache_get(s->frame_cache, key))) {
+            av_log(ctx, AV_LOG_DEBUG, "Frame cache hit for pts %"PRIu64"\n", slot->pts);
+            st->frame_cache_hit = 1;
+            ret = 0;
+            goto end;
+        }
+    }
+
+    if (slot->key_w && s->overfetch) {
+        if ((ret = fetch_cropped(&frame, ctx, slot, st)) < 0)
+            goto end;
+    } else if (slot->key_w) {
+        if ((ret = fetch_interpolated(&frame, ctx, slot, st)) < 0)
+            goto end;
+    } else if (s->nb_split_layers) {
+        if ((ret = fetch_layers(&frame, ctx, slot, st)) < 0)
+            goto end;
+    } else if ((s->max_width && s->w > s->max_width) || (s->max_height && s->h > s->max_height)) {
+        if ((ret = fetch_split(&frame, ctx, slot, s->fmt_url, dims, 1, st)) < 0)
+            goto end;
+    } else {
+        if (!(frame = av_frame_alloc())) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        if ((ret = get_frame(frame, ctx, slot->url, 1, st)) < 0) {
+            av_frame_free(&frame);
+            goto end;
+        }
+    }
+    if ((ret = convert_frame(&frame, s->pix_fmt)) < 0) {
+        av_frame_free(&frame);
+        goto end;
+    }
+    if (key)
+        ff_wms_frame_cache_put(s->frame_cache, key, frame);
+    *out = frame;
+end:
+    st->time[WMS_STAT_FETCH] = av_gettime_relative() - start;
+    av_free(key);
+    return ret;
 }
 
-static av_cold void uninit(AVFilterContext *ctx){
+static int fetch_slot_job(AVFilterContext *ctx, void *arg, int jobnr)
+{
     WMSContext *s = ctx->priv;
-    free(s->url);
-	free(s->service);
-	free(s->version);
-	av_free(s->fmt_url);
-    av_log(ctx, AV_LOG_DEBUG, "Successfully uninitialized WMS Context\n");
+    WMSSlot *slot = arg;
+    AVFrame *frame = NULL;
+    int64_t queue_wait = av_gettime_relative() - slot->queued;
+    WMSFrameStats st;
+    int ret = fetch_frame(&frame, ctx, slot, &st);
+
+    if (slot->key_w)
+        keyframe_unref(s, slot->key_group);
+
+    st.time[WMS_STAT_QUEUE] = queue_wait;
+    ff_mutex_lock(&s->lock);
+    slot->frame = frame;
+    slot->stats = st;
+    slot->ret   = ret;
+    slot->state = WMS_SLOT_DONE;
+    ff_cond_broadcast(&s->cond);
+    ff_mutex_unlock(&s->lock);
+    return ret;
 }
 
-static const char *const var_names[] = {
-    "xref", "yref", //reference
-    "x1","x2","y1","y2", //bbox
-    "t", //time
-    NULL
-};
+#define WMS_KEYFRAME_MAX_AREA 4 ///< largest keyframe, in frames
 
-enum var_name {
-    VAR_XREF,
-    VAR_YREF,
-    VAR_X1,
-    VAR_X2,
-    VAR_Y1,
-    VAR_Y2,
-    VAR_T,
-    VARS_NB
-};
+/**
+ * Compute the keyframe of the group of pts: it covers the bboxes of all
+ * the frames of the group plus a margin, at the finest of their
+ * resolutions. Bboxes are evaluated here, not by the fetch threads, as
+ * the expressions are not thread safe.
+ */
+static void prepare_keyframe(WMSContext *s, uint64_t pts, AVRational time_base)
+{
+    int64_t group = pts / s->keyframes;
+    double res_h = DBL_MAX, res_v = DBL_MAX, mh, mv;
+    WMSExtent u;
 
-static int parse_expressions(MapReadContext *mapctx, AVFilterLink *outlink) {
-    AVFilterContext *ctx = outlink->src;
-    WMSContext *s = ctx->priv;
-    int ret;
-    double var_values[VARS_NB], res;
-    char *expr;
+    if (group == s->key_group)
+        return;
+    s->key_group = group;
+    s->key_w = s->key_h = 0;
 
-    var_values[VAR_XREF] = NAN;
-    var_values[VAR_YREF] = NAN;
-    var_values[VAR_X1] = NAN;
-    var_values[VAR_X2] = NAN;
-    var_values[VAR_Y1] = NAN;
-    var_values[VAR_Y2] = NAN;
-    var_values[VAR_T] = s->pts * av_q2d(outlink->time_base);
+    eval_bboxes(s, s->key_maps, group * s->keyframes, s->keyframes, time_base);
+    u = map_to_extent(s, &s->key_maps[0]);
+    for (int i = 0; i < s->keyframes; i++) {
+        WMSExtent e = map_to_extent(s, &s->key_maps[i]);
+        u.h0  = FFMIN(u.h0, e.h0);
+        u.h1  = FFMAX(u.h1, e.h1);
+        u.v0  = FFMIN(u.v0, e.v0);
+        u.v1  = FFMAX(u.v1, e.v1);
+        res_h = FFMIN(res_h, (e.h1 - e.h0) / s->w);
+        res_v = FFMIN(res_v, (e.v1 - e.v0) / s->h);
+    }
+    if (!(res_h > 0 && res_v > 0 && isfinite(u.h1 - u.h0) && isfinite(u.v1 - u.v0)))
+        return;
+    mh = s->keyframe_margin * (u.h1 - u.h0);
+    mv = s->keyframe_margin * (u.v1 - u.v0);
+    u  = (WMSExtent){ u.h0 - mh, u.h1 + mh, u.v0 - mv, u.v1 + mv };
 
-    if ((ret = av_expr_parse_and_eval(&res, (expr = s->xref_expr),var_names, var_values,
-                                          NULL, NULL, NULL, NULL, NULL, 0, ctx)) < 0)
-        goto fail;
-    var_values[VAR_XREF] = res;
-    if ((ret = av_expr_parse_and_eval(&res, (expr = s->yref_expr),var_names, var_values,
-                                          NULL, NULL, NULL, NULL, NULL, 0, ctx)) < 0)
-        goto fail;
-    var_values[VAR_YREF] = res;
-    if ((ret = av_expr_parse_and_eval(&res, (expr = s->x1_expr),
-                                              var_names, var_values,
-                                              NULL, NULL, NULL, NULL, NULL, 0, ctx)) < 0)
-        goto fail;
-    mapctx->x1 = var_values[VAR_X1] = res;
-    if ((ret = av_expr_parse_and_eval(&res, (expr = s->x2_expr),var_names, var_values,
-                                              NULL, NULL, NULL, NULL, NULL, 0, ctx)) < 0)
-        goto fail;
-    mapctx->x2 = var_values[VAR_X2] = res;
-    if ((ret = av_expr_parse_and_eval(&res, (expr = s->y1_expr),var_names, var_values,
-                                              NULL, NULL, NULL, NULL, NULL, 0, ctx)) < 0)
-        goto fail;
-    mapctx->y1 = var_values[VAR_Y1] = res;
-    if ((ret = av_expr_parse_and_eval(&res, (expr = s->y2_expr),var_names, var_values,
-                                              NULL, NULL, NULL, NULL, NULL, 0, ctx)) < 0)
-        goto fail;
-    mapctx->y2 = var_values[VAR_Y2] = res;
+    // Zooming out or panning fast makes for keyframes larger than it is
+    // worth fetching, fall back to fetching every frame of the group
+    if ((u.h1 - u.h0) / res_h * (u.v1 - u.v0) / res_v > WMS_KEYFRAME_MAX_AREA * s->w * s->h ||
+        (s->max_width  && ceil((u.h1 - u.h0) / res_h) > s->max_width) ||
+        (s->max_height && ceil((u.v1 - u.v0) / res_v) > s->max_height)) {
+        av_log(s, AV_LOG_VERBOSE, "Keyframe too large, fetching frames %"PRId64" to %"PRId64"\n",
+               group * s->keyframes, (group + 1) * s->keyframes - 1);
+        return;
+    }
+    s->key_map = extent_to_map(s, &u);
+    s->key_w   = ceil((u.h1 - u.h0) / res_h);
+    s->key_h   = ceil((u.v1 - u.v0) / res_v);
+}
+
+/**
+ * Crop the frame of slot from the current overfetched image if it is still
+ * inside of it at the same resolution, within half a pixel, else start a
+ * new one padded by overfetch around it. Offsets are rounded to whole
+ * chroma samples.
+ */
+static void prepare_overfetch(WMSContext *s, WMSSlot *slot)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(s->pix_fmt);
+    WMSExtent e = map_to_extent(s, &slot->map), ke = map_to_extent(s, &s->key_map);
+    double res_h = (ke.h1 - ke.h0) / s->key_w, res_v = (ke.v1 - ke.v0) / s->key_h;
+    int px, py;
+
+    if (s->key_w) {
+        double x = (e.h0 - ke.h0) / res_h, y = (ke.v1 - e.v1) / res_v;
+        int align_x = 1 << desc->log2_chroma_w, align_y = 1 << desc->log2_chroma_h;
+
+        slot->key_x = lrint(x / align_x) * align_x;
+        slot->key_y = lrint(y / align_y) * align_y;
+        if (fabs((e.h1 - e.h0) / res_h - s->w) < 0.5 && fabs((e.v1 - e.v0) / res_v - s->h) < 0.5 &&
+            slot->key_x >= 0 && slot->key_x + s->w <= s->key_w &&
+            slot->key_y >= 0 && slot->key_y + s->h <= s->key_h)
+            goto found;
+    }
+
+    res_h = (e.h1 - e.h0) / s->w;
+    res_v = (e.v1 - e.v0) / s->h;
+    px = lrint(s->overfetch * s->w / 2) * 2;
+    py = lrint(s->overfetch * s->h / 2) * 2;
+    if (s->max_width)
+        px = FFMIN(px, (s->max_width - s->w) / 4 * 2);
+    if (s->max_height)
+        py = FFMIN(py, (s->max_height - s->h) / 4 * 2);
+    if (!(res_h > 0 && res_v > 0) || px <= 0 || py <= 0) {
+        s->key_w = 0;
+        return;
+    }
+    ke = (WMSExtent){ e.h0 - px * res_h, e.h1 + px * res_h, e.v0 - py * res_v, e.v1 + py * res_v };
+    s->key_group++;
+    s->key_map = extent_to_map(s, &ke);
+    s->key_w   = s->w + 2 * px;
+    s->key_h   = s->h + 2 * py;
+    slot->key_x = px;
+    slot->key_y = py;
+found:
+    slot->key_group = s->key_group;
+    slot->key_map   = s->key_map;
+    slot->key_w     = s->key_w;
+    slot->key_h     = s->key_h;
+}
+
+/**
+ * Build the GetMap URL of a slot whose bbox is set, unless tiles are
+ * fetched from a tile service, or tie it to the keyframe it is
+ * synthesized from
+ */
+static int prepare_slot(WMSSlot *slot, WMSContext *s, uint64_t pts, AVRational time_base)
+{
+    char dims[sizeof(slot->dims)];
+
+    slot->pts = pts;
+    slot->key_w = 0;
+    if (s->keyframes > 1) {
+        prepare_keyframe(s, pts, time_base);
+        slot->key_group = s->key_group;
+        slot->key_map   = s->key_map;
+        slot->key_w     = s->key_w;
+        slot->key_h     = s->key_h;
+    } else if (s->overfetch) {
+        prepare_overfetch(s, slot);
+    }
+    prepare_dimensions(s, slot, time_base);
+    // Tile services have no GetMap request
+    if (s->tile_service)
+        return 0;
+    dims_query(dims, sizeof(dims), slot, (1 << WMS_DIM_NB) - 1);
+    slot->url = format_getmap_url(s->fmt_url, &slot->map, s->w, s->h, dims);
+    if (!slot->url)
+        return AVERROR(ENOMEM);
+    if (slot->key_w && keyframe_ref(s, slot->key_group)) {
+        av_log(s, AV_LOG_WARNING, "No keyframe entry free, fetching frame %"PRIu64"\n", pts);
+        slot->key_w = 0;
+    }
+
+    // Animated dimensions often map consecutive frames to the same value
+    slot->repeat = 0;
+    if (s->nb_dims) {
+        slot->repeat = s->last_url && !strcmp(slot->url, s->last_url);
+        av_free(s->last_url);
+        if (!(s->last_url = av_strdup(slot->url)))
+            return AVERROR(ENOMEM);
+    }
+    if (slot->repeat) {
+        slot->stats = (WMSFrameStats){ .frame_cache_hit = 1 };
+        slot->ret   = 0;
+    }
     return 0;
-fail:
-    av_log(ctx, AV_LOG_ERROR,
-           "Error when evaluating the expression '%s'.\n",
-           expr);
-    return ret;
 }
 
 static int config_props(AVFilterLink *outlink)
 {
     AVFilterContext *ctx = outlink->src;
     WMSContext *s = ctx->priv;
+    int ret;
+
     if (av_image_check_size(s->w, s->h, 0, ctx) < 0)
         return AVERROR(EINVAL);
 
@@ -521,58 +4718,189 @@ static int config_props(AVFilterLink *outlink)
     outlink->h = s->h;
     outlink->time_base = av_inv_q(s->frame_rate);
     outlink->frame_rate = s->frame_rate;
-    return 0;
-}
 
-static int get_frame(AVFrame *dst, AVFilterContext *ctx, const char* url) {
-    int ret;
-    if ((ret = ff_load_image(dst->data, dst->linesize,
-                            &dst->width, &dst->height,
-                            &dst->format, url, ctx)) < 0)
+    if (!s->workers && (ret = init_pool(ctx)) < 0)
+        return ret;
+    if (!s->max_conns && (ret = init_conn_pool(ctx)) < 0)
+        return ret;
+    if (!s->decoders && (ret = init_decoder_pool(ctx)) < 0)
         return ret;
     return 0;
 }
 
-static AVMutex pts_mutex = AV_MUTEX_INITIALIZER;
+/**
+ * Reuse the previous frame for a frame of the same request
+ */
+static int repeat_frame(AVFrame **out, WMSContext *s)
+{
+    if (!s->last_frame)
+        return AVERROR_BUG;
+    return (*out = av_frame_clone(s->last_frame)) ? 0 : AVERROR(ENOMEM);
+}
 
-static int request_frame(AVFilterLink *link)
+/**
+ * Keep the frames of pts..pts+prefetch scheduled in the prefetch ring,
+ * evaluating all the new bboxes at once
+ */
+static int schedule_frames(AVFilterLink *link)
+{
+    AVFilterContext *ctx = link->src;
+    WMSContext *s = ctx->priv;
+    WMSSlot *slot;
+    int ret = 0;
+
+    ff_mutex_lock(&s->lock);
+    if (s->next_pts < s->pts)
+        s->next_pts = s->pts;
+    if (s->next_pts <= s->pts + s->prefetch && s->next_pts < s->end_pts) {
+        int nb_frames = FFMIN(s->pts + s->prefetch + 1, ceil(s->end_pts)) - s->next_pts;
+        eval_bboxes(s, s->maps, s->next_pts, nb_frames, link->time_base);
+        for (int i = 0; i < nb_frames; i++, s->next_pts++) {
+            slot = &s->slots[s->next_pts % s->nb_slots];
+            slot->map = s->maps[i];
+            if ((ret = prepare_slot(slot, s, s->next_pts, link->time_base)) < 0 ||
+                (!slot->repeat &&
+                 (ret = pool_submit(ctx, fetch_slot_job, slot, 0, s->next_pts, NULL)) < 0)) {
+                av_freep(&slot->url);
+                break;
+            }
+            slot->queued = av_gettime_relative();
+            slot->state  = slot->repeat ? WMS_SLOT_DONE : WMS_SLOT_QUEUED;
+        }
+    }
+    ff_mutex_unlock(&s->lock);
+    return ret;
+}
+
+/**
+ * Take the frame for s->pts from the prefetch ring, where it must be ready
+ */
+static int next_frame(AVFrame **out, WMSSlot *cur, AVFilterLink *link)
 {
-    int ret;
-    char *url;
-    AVFrame *picref;
-    AVFilterContext *ctx = link->dst;
     WMSContext *s = link->src->priv;
-    MapReadContext mctx = {0,0,0,0};
+    WMSSlot *slot;
+    int ret = AVERROR_BUG;
 
-    if((ret =parse_expressions(&mctx, link) < 0))
-        return ret;
+    ff_mutex_lock(&s->lock);
+    slot = &s->slots[s->pts % s->nb_slots];
+    if (slot->state == WMS_SLOT_DONE) {
+        *out = slot->frame;
+        ret  = slot->ret;
+        *cur = *slot;
+        slot->frame = NULL;
+        slot->url   = NULL;
+        slot->state = WMS_SLOT_EMPTY;
+    }
+    ff_mutex_unlock(&s->lock);
+    if (ret >= 0 && cur->repeat)
+        ret = repeat_frame(out, s);
+    return ret;
+}
 
-    picref = av_frame_alloc();
-    if (!picref)
-        return AVERROR(ENOMEM);
+#define WMS_WAIT 10000 ///< longest time activate() waits for a frame, in us
 
-    url = av_asprintf(s->fmt_url,
-        mctx.x1, mctx.y1, mctx.x2, mctx.y2);
+/**
+ * Wait until the frame for s->pts is fetched, timeout us at most
+ *
+ * @return whether it is
+ */
+static int wait_frame(WMSContext *s, int64_t timeout)
+{
+    int64_t t = av_gettime() + timeout;
+    struct timespec abstime = { .tv_sec  =  t / 1000000,
+                                .tv_nsec = (t % 1000000) * 1000 };
+    WMSSlot *slot;
+    int ready;
 
-    if ((ret = get_frame(picref, ctx, url)))
-        return ret;
+    ff_mutex_lock(&s->lock);
+    slot = &s->slots[s->pts % s->nb_slots];
+    while (!(ready = slot->state == WMS_SLOT_DONE && slot->pts == s->pts) &&
+           !ff_cond_timedwait(&s->cond, &s->lock, &abstime))
+        ;
+    ff_mutex_unlock(&s->lock);
+    return ready;
+}
+
+static int output_frame(AVFilterLink *link)
+{
+    int ret;
+    AVFrame *picref = NULL;
+    WMSContext *s = link->src->priv;
+    WMSSlot cur = { 0 };
+
+    if ((ret = next_frame(&picref, &cur, link)) < 0)
+        goto end;
+    if (s->nb_dims) {
+        av_frame_free(&s->last_frame);
+        if (!(s->last_frame = av_frame_clone(picref))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
 
     picref->duration = 1;
-    ff_mutex_lock(&pts_mutex);
     picref->pts = s->pts++;
-    av_log(s, AV_LOG_DEBUG, "Draw from pts: %ld [(%lf %lf), (%lf %lf)]\n", s->pts, mctx.x1, mctx.y1, mctx.x2, mctx.y2);
-    av_log(s, AV_LOG_DEBUG, "Used url: %s\r\n", url);
-    ff_mutex_unlock(&pts_mutex);
-    av_free(url);
+    stats_export(&picref->metadata, &cur.stats);
+    stats_account(s, &cur.stats);
+    if (s->stats_interval && !(s->nb_frames % s->stats_interval))
+        stats_log(link->src, AV_LOG_INFO);
+    av_log(s, AV_LOG_DEBUG, "Draw from pts: %ld [(%lf %lf), (%lf %lf)]\n", s->pts, cur.map.x1, cur.map.y1, cur.map.x2, cur.map.y2);
+    if (cur.url)
+        av_log(s, AV_LOG_DEBUG, "Used url: %s\r\n", cur.url);
+    av_free(cur.url);
 
     return ff_filter_frame(link, picref);
+end:
+    av_frame_free(&picref);
+    av_free(cur.url);
+    return ret;
+}
+
+static int query_formats(AVFilterContext *ctx)
+{
+    WMSContext *s = ctx->priv;
+    const enum AVPixelFormat pix_fmts[] = { s->pix_fmt, AV_PIX_FMT_NONE };
+    int ret;
+
+    if (s->pix_fmt == AV_PIX_FMT_YUV420P &&
+        (ret = ff_set_common_color_ranges(ctx, ff_make_formats_list_singleton(AVCOL_RANGE_JPEG))))
+        return ret;
+    return ff_set_common_formats_from_list(ctx, pix_fmts);
+}
+
+static int activate(AVFilterContext *ctx)
+{
+    AVFilterLink *outlink = ctx->outputs[0];
+    WMSContext *s = ctx->priv;
+    int ret;
+
+    if (!ff_outlink_frame_wanted(outlink))
+        return FFERROR_NOT_READY;
+    if (s->pts >= s->end_pts) {
+        ff_outlink_set_status(outlink, AVERROR_EOF, s->pts);
+        return 0;
+    }
+    if ((ret = schedule_frames(outlink)) < 0)
+        return ret;
+    // The workers cannot touch the filter state, so they cannot set it ready
+    // when done: stay scheduled below the other filters of the graph, and
+    // wait for the frame a little each time nothing else is to be done
+    if (!wait_frame(s, WMS_WAIT)) {
+        ff_filter_set_ready(ctx, 1);
+        return FFERROR_NOT_READY;
+    }
+    // The frame is lost, do not go on without it
+    if ((ret = output_frame(outlink)) < 0) {
+        ff_outlink_set_status(outlink, ret, s->pts);
+        return ret;
+    }
+    return 0;
 }
 
 static const AVFilterPad wms_outputs[] = {
     {
         .name          = "default",
         .type          = AVMEDIA_TYPE_VIDEO,
-        .request_frame = request_frame,
         .config_props  = config_props,
     },
 };
@@ -584,7 +4912,8 @@ const AVFilter ff_vsrc_wms = {
     .priv_class    = &wms_class,
     .init          = init,
     .uninit        = uninit,
+    .activate      = activate,
     .inputs        = NULL,
     FILTER_OUTPUTS(wms_outputs),
-    FILTER_SINGLE_PIXFMT(AV_PIX_FMT_0BGR32),
+    FILTER_QUERY_FUNC(query_formats),
 };
@@ -0,0 +1,554 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libavformat/avformat.h"
+#include "libavutil/avstring.h"
+#include "libavutil/mem.h"
+#include "libavutil/thread.h"
+#include "libavutil/tree.h"
+
+#include "wms_fetch.h"
+
+/**
+ * Entry of the frame cache. Entries without frame are claimed, their frame
+ * is being fetched.
+ */
+typedef struct WMSCachedFrame {
+    struct WMSCachedFrame *prev, *next;
+    char *key;
+    AVFrame *frame;
+    size_t size;
+} WMSCachedFrame;
+
+struct WMSFrameCache {
+    WMSCachedFrame *entries; ///< most recently used first
+    WMSCachedFrame *last;    ///< least recently used
+    struct AVTreeNode *index; ///< entries by key
+    int64_t size;           ///< budget in bytes
+    int64_t bytes;
+    AVMutex lock;
+    AVCond cond;            ///< signaled when a claimed entry lands
+};
+
+struct WMSHost {
+    char *name;             ///< scheme://host:port
+    AVIOContext **conns;    ///< idle keep-alive connections
+    int nb_conns;
+    int inflight;           ///< requests in flight of all the users
+    struct WMSHost *next;
+};
+
+struct WMSFlight {
+    char *url;
+    int cache;              ///< whether the response may come from the disk cache
+    AVFrame *frame;         ///< decoded response, once done
+    int done, ret;
+    int refs;
+    struct WMSFlight *next;
+};
+
+/**
+ * The frame cache has a lock of its own, everything else is protected by
+ * lock. The budgets are the sums of those of the users.
+ */
+struct WMSFetchService {
+    int refs;               ///< users, protected by fetch_svc_lock if shared
+    int running;            ///< users not stopped, likewise
+    atomic_int stopped;     ///< all the users stopped, requests are interrupted
+    AVIOInterruptCB int_cb;
+    int shared;
+    WMSHost *hosts;
+    int max_conns;          ///< idle connections kept per host
+    WMSFlight *flights;
+    WMSFrameCache cache;
+    AVMutex lock;
+    AVCond cond;            ///< signaled when a flight lands or a request to a host ends
+};
+
+static AVMutex fetch_svc_lock = AV_MUTEX_INITIALIZER;
+static WMSFetchService *fetch_svc; ///< service shared by the process
+
+static int cmp_cached_frame(const void *a, const void *b)
+{
+    const WMSCachedFrame *ea = a, *eb = b;
+    return strcmp(ea->key, eb->key);
+}
+
+static void frame_cache_unlink(WMSFrameCache *c, WMSCachedFrame *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        c->entries = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        c->last = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void frame_cache_push(WMSFrameCache *c, WMSCachedFrame *entry)
+{
+    entry->next = c->entries;
+    if (c->entries)
+        c->entries->prev = entry;
+    else
+        c->last = entry;
+    c->entries = entry;
+}
+
+static void frame_cache_remove(WMSFrameCache *c, WMSCachedFrame *entry)
+{
+    struct AVTreeNode *node = NULL;
+
+    av_tree_insert(&c->index, entry, cmp_cached_frame, &node);
+    av_free(node);
+    frame_cache_unlink(c, entry);
+    c->bytes -= entry->size;
+    av_frame_free(&entry->frame);
+    av_free(entry->key);
+    av_free(entry);
+}
+
+static av_cold int frame_cache_init(WMSFrameCache *c, int64_t size)
+{
+    int ret;
+
+    if ((ret = ff_mutex_init(&c->lock, NULL)))
+        return AVERROR(ret);
+    if ((ret = ff_cond_init(&c->cond, NULL))) {
+        ff_mutex_destroy(&c->lock);
+        return AVERROR(ret);
+    }
+    c->size = size;
+    return 0;
+}
+
+static av_cold void frame_cache_uninit(WMSFrameCache *c)
+{
+    while (c->entries)
+        frame_cache_remove(c, c->entries);
+    ff_cond_destroy(&c->cond);
+    ff_mutex_destroy(&c->lock);
+}
+
+/**
+ * Evict from the tail until the cache fits its budget, but keep the most
+ * recently used entry and the claimed ones. Must be called with c->lock held.
+ */
+static void frame_cache_trim(WMSFrameCache *c)
+{
+    WMSCachedFrame *entry = c->last, *prev;
+
+    for (; c->bytes > c->size && entry != c->entries; entry = prev) {
+        prev = entry->prev;
+        if (entry->frame)
+            frame_cache_remove(c, entry);
+    }
+}
+
+void ff_wms_frame_cache_reserve(WMSFrameCache *c, int64_t *budget, int64_t size)
+{
+    ff_mutex_lock(&c->lock);
+    if (size > *budget) {
+        c->size += size - *budget;
+        *budget  = size;
+    }
+    ff_mutex_unlock(&c->lock);
+}
+
+AVFrame *ff_wms_frame_cache_get(WMSFrameCache *c, const char *key)
+{
+    WMSCachedFrame *entry, k = { .key = (char *)key };
+    AVFrame *frame = NULL;
+
+    ff_mutex_lock(&c->lock);
+    if ((entry = av_tree_find(c->index, &k, cmp_cached_frame, NULL)) && entry->frame) {
+        frame = av_frame_clone(entry->frame);
+        frame_cache_unlink(c, entry);
+        frame_cache_push(c, entry);
+    }
+    ff_mutex_unlock(&c->lock);
+    return frame;
+}
+
+int ff_wms_frame_cache_claim(WMSFrameCache *c, const char *key, AVFrame **frame)
+{
+    WMSCachedFrame *entry, k = { .key = (char *)key };
+    struct AVTreeNode *node = av_tree_node_alloc();
+    int ret = 0;
+
+    if (!node)
+        return AVERROR(ENOMEM);
+    ff_mutex_lock(&c->lock);
+    while ((entry = av_tree_find(c->index, &k, cmp_cached_frame, NULL)) && !entry->frame)
+        ff_cond_wait(&c->cond, &c->lock);
+    if (entry) {
+        if ((*frame = av_frame_clone(entry->frame))) {
+            frame_cache_unlink(c, entry);
+            frame_cache_push(c, entry);
+        } else {
+            ret = AVERROR(ENOMEM);
+        }
+    } else if (!(entry = av_mallocz(sizeof(*entry))) ||
+               !(entry->key = av_strdup(key))) {
+        av_freep(&entry);
+        ret = AVERROR(ENOMEM);
+    } else {
+        av_tree_insert(&c->index, entry, cmp_cached_frame, &node);
+        frame_cache_push(c, entry);
+        ret = 1;
+    }
+    ff_mutex_unlock(&c->lock);
+    av_free(node);
+    return ret;
+}
+
+void ff_wms_frame_cache_abort(WMSFrameCache *c, const char *key)
+{
+    WMSCachedFrame *entry, k = { .key = (char *)key };
+
+    ff_mutex_lock(&c->lock);
+    if ((entry = av_tree_find(c->index, &k, cmp_cached_frame, NULL)) && !entry->frame)
+        frame_cache_remove(c, entry);
+    ff_cond_broadcast(&c->cond);
+    ff_mutex_unlock(&c->lock);
+}
+
+void ff_wms_frame_cache_put(WMSFrameCache *c, const char *key, const AVFrame *frame)
+{
+    WMSCachedFrame *entry = av_mallocz(sizeof(*entry)), *old;
+    struct AVTreeNode *node = av_tree_node_alloc();
+
+    if (!entry || !node)
+        goto fail;
+    entry->key   = av_strdup(key);
+    entry->frame = av_frame_clone(frame);
+    if (!entry->key || !entry->frame)
+        goto fail;
+    for (int i = 0; i < FF_ARRAY_ELEMS(frame->buf) && frame->buf[i]; i++)
+        entry->size += frame->buf[i]->size;
+
+    ff_mutex_lock(&c->lock);
+    // Another thread may have cached the same frame meanwhile
+    if ((old = av_tree_find(c->index, entry, cmp_cached_frame, NULL)))
+        frame_cache_remove(c, old);
+    av_tree_insert(&c->index, entry, cmp_cached_frame, &node);
+    frame_cache_push(c, entry);
+    c->bytes += entry->size;
+    frame_cache_trim(c);
+    ff_cond_broadcast(&c->cond);
+    ff_mutex_unlock(&c->lock);
+    return;
+fail:
+    if (entry) {
+        av_frame_free(&entry->frame);
+        av_free(entry->key);
+    }
+    av_free(entry);
+    av_free(node);
+    ff_wms_frame_cache_abort(c, key);
+}
+
+static int fetch_svc_interrupt(void *opaque)
+{
+    WMSFetchService *svc = opaque;
+    return atomic_load_explicit(&svc->stopped, memory_order_relaxed);
+}
+
+static av_cold WMSFetchService *fetch_svc_alloc(void)
+{
+    WMSFetchService *svc = av_mallocz(sizeof(*svc));
+
+    if (!svc)
+        return NULL;
+    atomic_init(&svc->stopped, 0);
+    svc->int_cb = (AVIOInterruptCB){ fetch_svc_interrupt, svc };
+    if (frame_cache_init(&svc->cache, 0) < 0)
+        goto fail;
+    if (ff_mutex_init(&svc->lock, NULL)) {
+        frame_cache_uninit(&svc->cache);
+        goto fail;
+    }
+    if (ff_cond_init(&svc->cond, NULL)) {
+        ff_mutex_destroy(&svc->lock);
+        frame_cache_uninit(&svc->cache);
+        goto fail;
+    }
+    return svc;
+fail:
+    av_free(svc);
+    return NULL;
+}
+
+static av_cold void fetch_svc_free(WMSFetchService *svc)
+{
+    while (svc->hosts) {
+        WMSHost *host = svc->hosts;
+        svc->hosts = host->next;
+        for (int i = 0; i < host->nb_conns; i++)
+            avio_closep(&host->conns[i]);
+        av_free(host->conns);
+        av_free(host->name);
+        av_free(host);
+    }
+    frame_cache_uninit(&svc->cache);
+    ff_cond_destroy(&svc->cond);
+    ff_mutex_destroy(&svc->lock);
+    av_free(svc);
+}
+
+av_cold int ff_wms_fetch_open(WMSFetchService **psvc, int shared, int64_t cache_size)
+{
+    WMSFetchService *svc;
+    int refs;
+
+    if (!shared) {
+        if (!(svc = fetch_svc_alloc()))
+            return AVERROR(ENOMEM);
+        svc->refs = svc->running = 1;
+        svc->cache.size = cache_size;
+        *psvc = svc;
+        return 1;
+    }
+    ff_mutex_lock(&fetch_svc_lock);
+    if (!fetch_svc && (fetch_svc = fetch_svc_alloc()))
+        fetch_svc->shared = 1;
+    if ((svc = fetch_svc)) {
+        refs = ++svc->refs;
+        svc->running++;
+        atomic_store_explicit(&svc->stopped, 0, memory_order_relaxed);
+        ff_mutex_lock(&svc->cache.lock);
+        svc->cache.size += cache_size;
+        ff_mutex_unlock(&svc->cache.lock);
+    }
+    ff_mutex_unlock(&fetch_svc_lock);
+    if (!svc)
+        return AVERROR(ENOMEM);
+    *psvc = svc;
+    return refs;
+}
+
+av_cold void ff_wms_fetch_close(WMSFetchService **psvc, int max_conns, int64_t cache_size)
+{
+    WMSFetchService *svc = *psvc;
+    int refs;
+
+    if (!svc)
+        return;
+    *psvc = NULL;
+    if (!svc->shared) {
+        fetch_svc_free(svc);
+        return;
+    }
+    ff_mutex_lock(&fetch_svc_lock);
+    if (!(refs = --svc->refs))
+        fetch_svc = NULL;
+    ff_mutex_unlock(&fetch_svc_lock);
+    if (!refs) {
+        fetch_svc_free(svc);
+        return;
+    }
+
+    ff_mutex_lock(&svc->lock);
+    svc->max_conns -= max_conns;
+    for (WMSHost *host = svc->hosts; host; host = host->next)
+        while (host->nb_conns > svc->max_conns)
+            avio_closep(&host->conns[--host->nb_conns]);
+    ff_mutex_unlock(&svc->lock);
+
+    ff_mutex_lock(&svc->cache.lock);
+    svc->cache.size -= cache_size;
+    frame_cache_trim(&svc->cache);
+    ff_mutex_unlock(&svc->cache.lock);
+}
+
+void ff_wms_fetch_stop(WMSFetchService *svc)
+{
+    if (svc->shared)
+        ff_mutex_lock(&fetch_svc_lock);
+    if (!--svc->running)
+        atomic_store_explicit(&svc->stopped, 1, memory_order_relaxed);
+    if (svc->shared)
+        ff_mutex_unlock(&fetch_svc_lock);
+}
+
+const AVIOInterruptCB *ff_wms_fetch_interrupt_cb(WMSFetchService *svc)
+{
+    return &svc->int_cb;
+}
+
+void ff_wms_fetch_add_conns(WMSFetchService *svc, int max_conns)
+{
+    ff_mutex_lock(&svc->lock);
+    svc->max_conns += max_conns;
+    ff_mutex_unlock(&svc->lock);
+}
+
+WMSFrameCache *ff_wms_fetch_cache(WMSFetchService *svc)
+{
+    return &svc->cache;
+}
+
+/**
+ * Find the host of url, adding it if it is new. Must be called with
+ * svc->lock held.
+ *
+ * @return the host, NULL on allocation failure
+ */
+static WMSHost *fetch_svc_host(WMSFetchService *svc, const char *url)
+{
+    char proto[16], hostname[1024], name[1100];
+    WMSHost *host;
+    int port;
+
+    av_url_split(proto, sizeof(proto), NULL, 0, hostname, sizeof(hostname), &port, NULL, 0, url);
+    snprintf(name, sizeof(name), "%s://%s:%d", proto, hostname, port);
+    for (host = svc->hosts; host && strcmp(host->name, name); host = host->next)
+        ;
+    if (host)
+        return host;
+    if (!(host = av_mallocz(sizeof(*host))) || !(host->name = av_strdup(name))) {
+        av_free(host);
+        return NULL;
+    }
+    host->next = svc->hosts;
+    svc->hosts = host;
+    return host;
+}
+
+WMSHost *ff_wms_host_acquire(WMSFetchService *svc, const char *url, int max_inflight)
+{
+    WMSHost *host;
+
+    ff_mutex_lock(&svc->lock);
+    if ((host = fetch_svc_host(svc, url))) {
+        while (max_inflight && host->inflight >= max_inflight)
+            ff_cond_wait(&svc->cond, &svc->lock);
+        host->inflight++;
+    }
+    ff_mutex_unlock(&svc->lock);
+    return host;
+}
+
+void ff_wms_host_release(WMSFetchService *svc, WMSHost *host)
+{
+    if (!host)
+        return;
+    ff_mutex_lock(&svc->lock);
+    host->inflight--;
+    ff_cond_broadcast(&svc->cond);
+    ff_mutex_unlock(&svc->lock);
+}
+
+AVIOContext *ff_wms_conn_acquire(WMSFetchService *svc, const char *url)
+{
+    AVIOContext *pb = NULL;
+    WMSHost *host;
+
+    ff_mutex_lock(&svc->lock);
+    if ((host = fetch_svc_host(svc, url)) && host->nb_conns)
+        pb = host->conns[--host->nb_conns];
+    ff_mutex_unlock(&svc->lock);
+    return pb;
+}
+
+void ff_wms_conn_release(WMSFetchService *svc, const char *url, AVIOContext *pb)
+{
+    WMSHost *host;
+
+    ff_mutex_lock(&svc->lock);
+    if ((host = fetch_svc_host(svc, url)) && host->nb_conns < svc->max_conns) {
+        AVIOContext **conns = av_realloc_array(host->conns, host->nb_conns + 1,
+                                               sizeof(*host->conns));
+        if (conns) {
+            host->conns = conns;
+            host->conns[host->nb_conns++] = pb;
+            pb = NULL;
+        }
+    }
+    ff_mutex_unlock(&svc->lock);
+    avio_closep(&pb);
+}
+
+/**
+ * Must be called with svc->lock held
+ */
+static void flight_unref(WMSFlight *f)
+{
+    if (--f->refs)
+        return;
+    av_frame_free(&f->frame);
+    av_free(f->url);
+    av_free(f);
+}
+
+int ff_wms_flight_join(WMSFetchService *svc, WMSFlight **flight, const char *url,
+                       int cache, AVFrame *dst)
+{
+    WMSFlight *f;
+    int ret;
+
+    ff_mutex_lock(&svc->lock);
+    for (f = svc->flights; f && (strcmp(f->url, url) || f->cache > cache); f = f->next)
+        ;
+    if (f) {
+        f->refs++;
+        while (!f->done)
+            ff_cond_wait(&svc->cond, &svc->lock);
+        ret = f->ret < 0 ? f->ret : av_frame_ref(dst, f->frame);
+        flight_unref(f);
+        ff_mutex_unlock(&svc->lock);
+        return ret;
+    }
+    if (!(f = av_mallocz(sizeof(*f))) || !(f->url = av_strdup(url))) {
+        av_free(f);
+        ff_mutex_unlock(&svc->lock);
+        return AVERROR(ENOMEM);
+    }
+    f->cache = cache;
+    f->refs  = 1;
+    f->next  = svc->flights;
+    svc->flights = f;
+    ff_mutex_unlock(&svc->lock);
+    *flight = f;
+    return 1;
+}
+
+void ff_wms_flight_land(WMSFetchService *svc, WMSFlight *f, int ret,
+                        const AVFrame *frame)
+{
+    ff_mutex_lock(&svc->lock);
+    f->ret = ret;
+    if (ret >= 0 && !(f->frame = av_frame_clone(frame)))
+        f->ret = AVERROR(ENOMEM);
+    f->done = 1;
+    for (WMSFlight **p = &svc->flights; *p; p = &(*p)->next) {
+        if (*p == f) {
+            *p = f->next;
+            break;
+        }
+    }
+    ff_cond_broadcast(&svc->cond);
+    flight_unref(f);
+    ff_mutex_unlock(&svc->lock);
+}
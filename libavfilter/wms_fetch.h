@@ -0,0 +1,187 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Fetch service of the wms source: keep-alive connections and requests in
+ * flight per host, requests in flight, so that identical concurrent
+ * requests are sent once, and a cache of decoded frames. A service is
+ * either private to an instance or shared by all the instances of the
+ * process having the shared option.
+ */
+
+#ifndef AVFILTER_WMS_FETCH_H
+#define AVFILTER_WMS_FETCH_H
+
+#include <stdint.h>
+
+#include "libavformat/avio.h"
+#include "libavutil/frame.h"
+
+/**
+ * LRU cache of decoded frames with a memory budget, indexed by key.
+ * This structure is opaque, it belongs to a fetch service.
+ */
+typedef struct WMSFrameCache WMSFrameCache;
+
+/**
+ * Server of the requests, as scheme://host:port
+ */
+typedef struct WMSHost WMSHost;
+
+/**
+ * Request in flight, its response goes to all the frames waiting for it
+ */
+typedef struct WMSFlight WMSFlight;
+
+typedef struct WMSFetchService WMSFetchService;
+
+/**
+ * Get a fetch service.
+ *
+ * @param shared     join the service shared by the instances of the process
+ *                   rather than creating a private one
+ * @param cache_size memory budget the caller brings to the frame cache, in
+ *                   bytes
+ * @return the number of instances using the service, a negative error code
+ *         on failure
+ */
+int ff_wms_fetch_open(WMSFetchService **svc, int shared, int64_t cache_size);
+
+/**
+ * Give back what the caller brought to the budgets of the service, and free
+ * it if it was its last user.
+ *
+ * @param max_conns  as given to ff_wms_fetch_add_conns(), 0 if not called
+ * @param cache_size as given to ff_wms_fetch_open() and raised by
+ *                   ff_wms_frame_cache_reserve()
+ */
+void ff_wms_fetch_close(WMSFetchService **svc, int max_conns, int64_t cache_size);
+
+/**
+ * Keep max_conns more idle keep-alive connections per host.
+ */
+void ff_wms_fetch_add_conns(WMSFetchService *svc, int max_conns);
+
+/**
+ * Stop using the service: once all its users stopped, the requests in
+ * flight are interrupted. Must be called before waiting for them.
+ */
+void ff_wms_fetch_stop(WMSFetchService *svc);
+
+/**
+ * @return the interrupt callback of the connections of the service: they
+ *         are shared, so they outlive the user opening them
+ */
+const AVIOInterruptCB *ff_wms_fetch_interrupt_cb(WMSFetchService *svc);
+
+/**
+ * @return the frame cache of the service
+ */
+WMSFrameCache *ff_wms_fetch_cache(WMSFetchService *svc);
+
+/**
+ * Wait until the host of url has room for one more request of the users of
+ * the service.
+ *
+ * @param max_inflight maximum number of requests in flight to the host, 0
+ *                     for unlimited
+ * @return the host to release the request to, NULL on allocation failure
+ */
+WMSHost *ff_wms_host_acquire(WMSFetchService *svc, const char *url, int max_inflight);
+
+/**
+ * End a request started with ff_wms_host_acquire(), host may be NULL.
+ */
+void ff_wms_host_release(WMSFetchService *svc, WMSHost *host);
+
+/**
+ * Get an idle keep-alive connection to the host of url. Connections keep
+ * the options they were opened with.
+ *
+ * @return the connection, NULL if there is none
+ */
+AVIOContext *ff_wms_conn_acquire(WMSFetchService *svc, const char *url);
+
+/**
+ * Keep a connection to the host of url for the next requests, or close it
+ * if enough are kept already.
+ */
+void ff_wms_conn_release(WMSFetchService *svc, const char *url, AVIOContext *pb);
+
+/**
+ * Wait for the response to url if a request for it is in flight, else
+ * start a flight for it.
+ *
+ * @param cache whether the response may come from the disk cache: such a
+ *              response does not do for a request that may not
+ * @return 0 with dst referencing the response of the flight waited for,
+ *         1 with *flight set if the caller must send the request and call
+ *         ff_wms_flight_land(), a negative error code on failure of the
+ *         flight waited for or of the allocation
+ */
+int ff_wms_flight_join(WMSFetchService *svc, WMSFlight **flight, const char *url,
+                       int cache, AVFrame *dst);
+
+/**
+ * Hand the response to a flight started by ff_wms_flight_join() to the
+ * callers waiting for it.
+ *
+ * @param ret   result of the request
+ * @param frame decoded response, if ret is not negative
+ */
+void ff_wms_flight_land(WMSFetchService *svc, WMSFlight *flight, int ret,
+                        const AVFrame *frame);
+
+/**
+ * Raise the budget the caller brought to the frame cache.
+ *
+ * @param budget budget the caller brought, updated, only accessed with the
+ *               lock of the cache held
+ * @param size   new budget, ignored if not over *budget
+ */
+void ff_wms_frame_cache_reserve(WMSFrameCache *c, int64_t *budget, int64_t size);
+
+/**
+ * @return a new reference to the cached frame for key, or NULL
+ */
+AVFrame *ff_wms_frame_cache_get(WMSFrameCache *c, const char *key);
+
+/**
+ * Get the cached frame for key like ff_wms_frame_cache_get(), or claim it
+ * if it is missing: the caller must then fetch it and
+ * ff_wms_frame_cache_put() it, or call ff_wms_frame_cache_abort() on
+ * failure. Other callers of ff_wms_frame_cache_claim() wait for it
+ * meanwhile rather than fetching it again.
+ *
+ * @return 0 with *frame set if cached, 1 if claimed, a negative error code
+ */
+int ff_wms_frame_cache_claim(WMSFrameCache *c, const char *key, AVFrame **frame);
+
+/**
+ * Drop the claim on key taken by ff_wms_frame_cache_claim()
+ */
+void ff_wms_frame_cache_abort(WMSFrameCache *c, const char *key);
+
+/**
+ * Cache a new reference to frame for key, evicting the least recently used
+ * frames over the budget. A claim on key is dropped, even on failure.
+ */
+void ff_wms_frame_cache_put(WMSFrameCache *c, const char *key, const AVFrame *frame);
+
+#endif /* AVFILTER_WMS_FETCH_H */
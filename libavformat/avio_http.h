@@ -0,0 +1,66 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVFORMAT_AVIO_HTTP_H
+#define AVFORMAT_AVIO_HTTP_H
+
+/**
+ * @file
+ * HTTP keep-alive for AVIOContext users outside of libavformat, which have
+ * no access to the URLContext of the connection.
+ */
+
+#include "libavutil/dict.h"
+
+#include "avio.h"
+
+/**
+ * Open uri for reading like avio_open2(), additionally returning the HTTP
+ * status code of the response, also when opening fails because of it.
+ *
+ * @param int_cb an interrupt callback to be used at the protocols level,
+ * may be NULL
+ * @param options as for avio_open2(), protocol_whitelist applies to uri and
+ * to the protocols it is opened over
+ * @param http_code set to the status code of the last response if uri is a
+ * http or https resource, else or without response to 0
+ * @return a negative value if an error condition occurred, 0 otherwise
+ */
+int avpriv_http_open(AVIOContext **pb, const char *uri, const AVIOInterruptCB *int_cb,
+                     AVDictionary **options, int *http_code);
+
+/**
+ * Send a new HTTP request, reusing the connection of an AVIOContext opened
+ * with avio_open2() or avpriv_http_open() and the multiple_requests option
+ * set.
+ *
+ * The previous response must have been fully read.
+ *
+ * @param pb AVIOContext of a http or https resource
+ * @param uri uri used to perform the request, on the same host
+ * @param options  A dictionary filled with HTTP options. On return
+ * this parameter will be destroyed and replaced with a dict containing options
+ * that were not found. May be NULL.
+ * @return a negative value if an error condition occurred, 0
+ * otherwise. AVERROR(EINVAL) means pb is not a http or https resource of
+ * the same host, AVERROR_EOF that the server closed the connection. A new
+ * one must be opened in both cases.
+ */
+int avpriv_http_do_new_request(AVIOContext *pb, const char *uri, AVDictionary **options);
+
+#endif /* AVFORMAT_AVIO_HTTP_H */
@@ -36,6 +36,7 @@
 #include "libavutil/parseutils.h"
 
 #include "avformat.h"
+#include "avio_internal.h"
 #include "http.h"
 #include "httpauth.h"
 #include "internal.h"
@@ -137,6 +138,11 @@ typedef struct HTTPContext {
     char *new_location;
     AVDictionary *redirect_cache;
     uint64_t filesize_from_content_range;
+    char *if_none_match;
+    char *if_modified_since;
+    char *etag;
+    char *last_modified;
+    char *cache_control;
 } HTTPContext;
 
 #define OFFSET(x) offsetof(HTTPContext, x)
@@ -156,6 +162,12 @@ static const AVOption options[] = {
     { "post_data", "set custom HTTP post data", OFFSET(post_data), AV_OPT_TYPE_BINARY, .flags = D | E },
     { "mime_type", "export the MIME type", OFFSET(mime_type), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY },
     { "http_version", "export the http response version", OFFSET(http_version), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY },
+    { "http_code", "export the http response status code", OFFSET(http_code), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 999, AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY },
+    { "if_none_match", "set an entity tag to make the request conditional", OFFSET(if_none_match), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, D },
+    { "if_modified_since", "set an HTTP date to make the request conditional", OFFSET(if_modified_since), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, D },
+    { "etag", "export the entity tag of the response", OFFSET(etag), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY },
+    { "last_modified", "export the Last-Modified date of the response", OFFSET(last_modified), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY },
+    { "cache_control", "export the Cache-Control header of the response", OFFSET(cache_control), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, AV_OPT_FLAG_EXPORT | AV_OPT_FLAG_READONLY },
     { "cookies", "set cookies to be sent in applicable future requests, use newline delimited Set-Cookie HTTP field value syntax", OFFSET(cookies), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, D },
     { "icy", "request ICY metadata", OFFSET(icy), AV_OPT_TYPE_BOOL, { .i64 = 1 }, 0, 1, D },
     { "icy_metadata_headers", "return ICY metadata headers", OFFSET(icy_metadata_headers), AV_OPT_TYPE_STRING, { .str = NULL }, 0, 0, AV_OPT_FLAG_EXPORT },
@@ -359,6 +371,9 @@ static int http_open_cnx(URLContext *h, AVDictionary **options)
     uint64_t off;
     char *cached;
 
+    /* do not export the status of a previous request if this one gets none */
+    s->http_code = 0;
+
 redo:
 
     cached = redirect_cache_get(s);
@@ -514,6 +529,42 @@ int ff_http_do_new_request2(URLContext *h, const char *uri, AVDictionary **opts)
     return ret;
 }
 
+int avpriv_http_open(AVIOContext **pb, const char *uri, const AVIOInterruptCB *int_cb,
+                     AVDictionary **options, int *http_code)
+{
+    URLContext *h;
+    int ret;
+
+    *pb        = NULL;
+    *http_code = 0;
+    if ((ret = ffurl_alloc(&h, uri, AVIO_FLAG_READ, int_cb)) < 0)
+        return ret;
+    if (options &&
+        ((ret = av_opt_set_dict(h, options)) < 0 ||
+         (h->prot->priv_data_class &&
+          (ret = av_opt_set_dict(h->priv_data, options)) < 0)))
+        goto fail;
+    ret = ffurl_connect(h, options);
+    /* the context is freed on failure, take the status code before */
+    if (!strcmp(h->prot->name, "http") || !strcmp(h->prot->name, "https"))
+        *http_code = ((HTTPContext *)h->priv_data)->http_code;
+    if (ret >= 0 && (ret = ffio_fdopen(pb, h)) >= 0)
+        return 0;
+fail:
+    ffurl_closep(&h);
+    return ret;
+}
+
+int avpriv_http_do_new_request(AVIOContext *pb, const char *uri, AVDictionary **options)
+{
+    URLContext *h = ffio_geturlcontext(pb);
+
+    if (!h)
+        return AVERROR(EINVAL);
+    pb->eof_reached = 0;
+    return ff_http_do_new_request2(h, uri, options);
+}
+
 int ff_http_averror(int status_code, int default_averror)
 {
     switch (status_code) {
@@ -1222,6 +1273,17 @@ static int process_line(URLContext *h, char *line, int line_count)
             parse_expires(s, p);
         } else if (!av_strcasecmp(tag, "Cache-Control")) {
             parse_cache_control(s, p);
+            av_free(s->cache_control);
+            if (!(s->cache_control = av_strdup(p)))
+                return AVERROR(ENOMEM);
+        } else if (!av_strcasecmp(tag, "ETag")) {
+            av_free(s->etag);
+            if (!(s->etag = av_strdup(p)))
+                return AVERROR(ENOMEM);
+        } else if (!av_strcasecmp(tag, "Last-Modified")) {
+            av_free(s->last_modified);
+            if (!(s->last_modified = av_strdup(p)))
+                return AVERROR(ENOMEM);
         }
     }
     return 1;
@@ -1334,6 +1396,9 @@ static int http_read_header(URLContext *h)
     int err = 0;
 
     av_freep(&s->new_location);
+    av_freep(&s->etag);
+    av_freep(&s->last_modified);
+    av_freep(&s->cache_control);
     s->expires = 0;
     s->chunksize = UINT64_MAX;
     s->filesize_from_content_range = UINT64_MAX;
@@ -1356,6 +1421,12 @@ static int http_read_header(URLContext *h)
     if (s->filesize_from_content_range != UINT64_MAX)
         s->filesize = s->filesize_from_content_range;
 
+    // A 304 never has a body, whatever its headers say
+    if (s->http_code == 304) {
+        s->filesize  = 0;
+        s->chunksize = UINT64_MAX;
+    }
+
     if (s->seekable == -1 && s->is_mediagateway && s->filesize == 2000000000)
         h->is_streamed = 1; /* we can in fact _not_ seek */
 
@@ -1494,6 +1565,10 @@ static int http_connect(URLContext *h, const char *path, const char *local_path,
     }
     if (!has_header(s->headers, "\r\nIcy-MetaData: ") && s->icy)
         av_bprintf(&request, "Icy-MetaData: 1\r\n");
+    if (!has_header(s->headers, "\r\nIf-None-Match: ") && s->if_none_match && *s->if_none_match)
+        av_bprintf(&request, "If-None-Match: %s\r\n", s->if_none_match);
+    if (!has_header(s->headers, "\r\nIf-Modified-Since: ") && s->if_modified_since && *s->if_modified_since)
+        av_bprintf(&request, "If-Modified-Since: %s\r\n", s->if_modified_since);
 
     /* now add in custom headers */
     if (s->headers)
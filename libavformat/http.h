@@ -22,6 +22,7 @@
 #ifndef AVFORMAT_HTTP_H
 #define AVFORMAT_HTTP_H
 
+#include "avio_http.h"
 #include "url.h"
 
 #define HTTP_HEADERS_SIZE 4096
@@ -617,6 +617,27 @@ concat(){
     fi
 }
 
+wms_caps_cache(){
+    caps=$1
+    opts=$2
+    frames=$3
+
+    url="${outdir}/${test}.xml"
+    cache="${outdir}/${test}.cache"
+    wms="wms=url=$(target_path $url):cache_dir=$(target_path $cache):$opts"
+
+    # Fill the cache, then make it the only source of the capabilities
+    rm -rf "$cache"
+    mkdir -p "$cache"
+    cp "$caps" "${url}?request=GetCapabilities"
+    ffmpeg -lavfi "$wms" -frames:v $frames -f null - || return
+    rm -f "${url}?request=GetCapabilities"
+    framecrc -lavfi "$wms" -frames:v $frames
+    err=$?
+    rm -rf "$cache"
+    return $err
+}
+
 venc_data(){
     file=$1
     stream=$2
@@ -112,6 +112,63 @@ fate-filter-yuvtestsrc-yuv444p: CMD = framecrc -lavfi yuvtestsrc=rate=5:duration
 FATE_FILTER-$(call FILTERFRAMECRC, YUVTESTSRC SCALE) += fate-filter-yuvtestsrc-yuv444p12
 fate-filter-yuvtestsrc-yuv444p12: CMD = framecrc -lavfi yuvtestsrc=rate=5:duration=1,format=yuv444p12,scale -pix_fmt yuv444p12le
 
+# Images served to the wms filter: the 4 XYZ tiles of zoom level 1 and the
+# keyframes of the 2 first groups, named after their bbox. They are all
+# generated with the first one.
+WMS_IMAGES = $(addprefix tests/data/wms-, 1-0-0.png 1-1-0.png 1-0-1.png 1-1-1.png \
+                                          0.000000_0.000000_256.000000_256.000000.png \
+                                          4.000000_0.000000_260.000000_256.000000.png)
+WMS_CROPS  = 0:0 96:0 0:32 96:32 48:16 40:16
+
+tests/data/wms-1-0-0.png: TAG = GEN
+tests/data/wms-1-0-0.png: ffmpeg$(PROGSSUF)$(EXESUF) $(VREF) | tests/data
+	$(M)$(TARGET_EXEC) $(TARGET_PATH)/$< -nostdin -f image2 -c:v pgmyuv -i $(TARGET_PATH)/tests/vsynth1/%02d.pgm \
+        -filter_complex "sws_flags=+accurate_rnd+bitexact;scale,format=gray,split=6$(foreach i,1 2 3 4 5 6,[s$(i)])$(foreach i,1 2 3 4 5 6,;[s$(i)]crop=256:256:$(word $(i),$(WMS_CROPS))[t$(i)])" \
+        $(foreach i,1 2 3 4 5 6,-map "[t$(i)]" -frames:v 1 -y $(TARGET_PATH)/$(word $(i),$(WMS_IMAGES))) 2>/dev/null
+
+FATE_FILTER_WMS_XYZ = fate-filter-wms-xyz fate-filter-wms-xyz-prefetch
+FATE_FILTER_WMS_KEYFRAMES = fate-filter-wms-keyframes fate-filter-wms-keyframes-prefetch
+FATE_FILTER_WMS = $(FATE_FILTER_WMS_XYZ) $(FATE_FILTER_WMS_KEYFRAMES)
+FATE_FILTER-$(call FILTERFRAMECRC, WMS SPLIT CROP SCALE FORMAT, IMAGE2_DEMUXER PGMYUV_DECODER \
+                   IMAGE2_MUXER PNG_ENCODER PNG_DECODER FILE_PROTOCOL) += $(FATE_FILTER_WMS)
+$(FATE_FILTER_WMS): tests/data/wms-1-0-0.png
+$(FATE_FILTER_WMS_XYZ): CMD = framecrc -lavfi "wms=url=%$(TARGET_PATH)/tests/data/wms-{z}-{x}-{y}.png:max_zoom=1:s=160x120:x1=-100+t*50:x2=60+t*50:y1=-60:y2=60:end_pts=8$(WMS_OPTS)"
+$(FATE_FILTER_WMS_KEYFRAMES): CMD = framecrc -lavfi "wms=url=%$(TARGET_PATH)/tests/data/wms-{x1}_{y1}_{x2}_{y2}.png:r=1:s=253x256:x1=t:x2=253+t:y1=0:y2=256:keyframes=4:keyframe_margin=0:end_pts=8$(WMS_OPTS)"
+# Prefetched frames must be output in order, identical to the ones fetched one at a time
+fate-filter-wms-%-prefetch: WMS_OPTS = :prefetch=6:threads=3
+fate-filter-wms-%-prefetch: REF = $(SRC_PATH)/tests/ref/fate/$(@:fate-%-prefetch=%)
+
+# GetCapabilities of a WMS and the GetMap responses the tests request from
+# it, in files named after the requests: the 2 layers of a bbox, the top one
+# transparent, and the base layer at 3 elevations. Such names are not valid
+# DOS paths.
+WMS_GETMAP = tests/data/wms-map?service=WMS&version=1.1.1&request=GetMap&layers=
+WMS_BBOX   = &styles=&format=image%2Fpng&bbox=0.000000,0.000000,64.000000,48.000000&width=64&height=48&srs=EPSG:4326
+WMS_MAPS   = base$(WMS_BBOX) top$(WMS_BBOX)&transparent=TRUE $(foreach e,0 25 50,base$(WMS_BBOX)&elevation=$(e))
+WMS_MAP_FILTERS = crop=64:48:0:0 \
+                  crop=64:48:0:0,format=rgba,drawbox=c=black@0:t=fill:replace=1,drawbox=16:8:32:32:red@0.5:t=fill:replace=1 \
+                  crop=64:48:32:16 crop=64:48:64:32 crop=64:48:96:48
+
+tests/data/wms-caps.xml: TAG = GEN
+tests/data/wms-caps.xml: ffmpeg$(PROGSSUF)$(EXESUF) $(VREF) $(SRC_PATH)/tests/wms-capabilities.xml | tests/data
+	$(M)$(TARGET_EXEC) $(TARGET_PATH)/$< -nostdin -f image2 -c:v pgmyuv -i $(TARGET_PATH)/tests/vsynth1/%02d.pgm \
+        -filter_complex "sws_flags=+accurate_rnd+bitexact;scale,format=gray,split=5$(foreach i,1 2 3 4 5,[s$(i)])$(foreach i,1 2 3 4 5,;[s$(i)]$(word $(i),$(WMS_MAP_FILTERS))[m$(i)])" \
+        $(foreach i,1 2 3 4 5,-map "[m$(i)]" -frames:v 1 -f image2 -c:v png -update 1 -y '$(TARGET_PATH)/$(WMS_GETMAP)$(word $(i),$(WMS_MAPS))') 2>/dev/null
+	$(Q)sed 's|@MAP@|$(TARGET_PATH)/tests/data/wms-map|' $(SRC_PATH)/tests/wms-capabilities.xml > $@
+	$(Q)cp $@ '$@?request=GetCapabilities'
+
+FATE_FILTER_WMS_CAPS-$(!HAVE_DOS_PATHS) = fate-filter-wms-split-layers fate-filter-wms-elevation fate-filter-wms-caps-cache
+FATE_FILTER-$(call FILTERFRAMECRC, WMS SPLIT CROP SCALE FORMAT DRAWBOX, IMAGE2_DEMUXER PGMYUV_DECODER \
+                   IMAGE2_MUXER PNG_ENCODER PNG_DECODER FILE_PROTOCOL) += $(FATE_FILTER_WMS_CAPS-yes)
+$(FATE_FILTER_WMS_CAPS-yes): tests/data/wms-caps.xml
+WMS_CAPS = s=64x48:x1=0:x2=64:y1=0:y2=48
+# The transparent top layer is composited over the base one
+fate-filter-wms-split-layers: CMD = framecrc -lavfi "wms=url=$(TARGET_PATH)/tests/data/wms-caps.xml:$(WMS_CAPS):layers=base\,top:split_layers=1:end_pts=2"
+# Elevations 0, 10, 20, 30, 40 and 50 snap to 0, 0, 25, 25, 50 and 50
+fate-filter-wms-elevation: CMD = framecrc -lavfi "wms=url=$(TARGET_PATH)/tests/data/wms-caps.xml:$(WMS_CAPS):layers=base:r=1:elevation=t*10:end_pts=6"
+# Capabilities read back from the disk cache must do as well as the document
+fate-filter-wms-caps-cache: CMD = wms_caps_cache tests/data/wms-caps.xml "$(WMS_CAPS):layers=base" 2
+
 FATE_FILTER-$(call FILTERFRAMECRC, TESTSRC FORMAT CONCAT SCALE, LAVFI_INDEV FILE_PROTOCOL) += fate-filter-lavd-scalenorm
 fate-filter-lavd-scalenorm: tests/data/filtergraphs/scalenorm
 fate-filter-lavd-scalenorm: CMD = framecrc -f lavfi -graph_file $(TARGET_PATH)/tests/data/filtergraphs/scalenorm -i dummy